@@ -0,0 +1,367 @@
+//
+// Benchmarks for the probability kernels and searches.
+//
+// Each benchmark is repeated until it has run for at least the minimum time, and is reported as one JSON object per
+// line on stdout so results can be collected and compared between builds.
+//
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+#include "../rs/InventionTypes.h"
+#include "../rs/Component.h"
+#include "../rs/Perk.h"
+#include "../rs/Probability.h"
+#include "../rs/Gizmo.h"
+#include "../rs/GizmoPrefixState.h"
+#include "../rs/RollCdfCache.h"
+#include "../rs/DistributionCache.h"
+#include "../rs/SimdKernels.h"
+#include "../rs/OptimalGizmoSearch.h"
+
+
+// Gives the benchmarks access to the individual stages of the calculation.
+struct GizmoBenchmarks {
+    static std::vector<Perk> perkInsertionOrder(const Gizmo &gizmo) {
+        return gizmo.perkInsertionOrder();
+    }
+
+    // Includes working out the insertion order, which is part of evaluating a gizmo on its own.
+    static std::vector<std::shared_ptr<const CDF>> perkRollCdf(const Gizmo &gizmo) {
+        return gizmo.perkRollCdf(gizmo.perkInsertionOrder());
+    }
+
+    static void perkRankProbabilities(const Gizmo &gizmo, const std::vector<Perk> &insertion_order,
+                                      const std::vector<const CDF *> &perk_contrib_cdf,
+                                      PerkRankTable &rank_probabilities) {
+        gizmo.perkRankProbabilities(insertion_order, perk_contrib_cdf, rank_probabilities);
+    }
+
+    static size_t perkCombinationProbabilities(const Gizmo &gizmo, const PerkRankTable &rank_probabilities) {
+        return gizmo.perkCombinationProbabilities(rank_probabilities).size();
+    }
+
+    static const std::vector<Gizmo> &candidates(const OptimalGizmoSearch &search) {
+        return search.candidate_gizmos_;
+    }
+};
+
+namespace {
+    // Stop the compiler from optimising away a result which is never used.
+    template<typename T>
+    inline void keep(const T &value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    struct BenchmarkCase {
+        GizmoType gizmo_type;
+        EquipmentType equipment_type;
+        level_t invention_level;
+        GizmoResult target;
+
+        [[nodiscard]] std::string name() const {
+            std::stringstream name;
+            name << gizmo_type << " " << equipment_type << " " << unsigned(invention_level) << " " << target;
+            return name.str();
+        }
+    };
+
+    std::vector<BenchmarkCase> benchmarkCorpus() {
+        return {
+                {STANDARD, WEAPON, 120, {{Perk::get("Precise"), 4}, {Perk::get("Equilibrium"), 2}}},
+                {STANDARD, TOOL, 90, {{Perk::get("Efficient"), 3}, {Perk::no_effect, 0}}},
+                {STANDARD, ARMOUR, 120, {{Perk::get("Crackling"), 3}, {Perk::get("Mobile"), 1}}},
+                {ANCIENT, WEAPON, 137, {{Perk::get("Aftershock"), 4}, {Perk::get("Precise"), 5}}},
+                {ANCIENT, TOOL, 120, {{Perk::get("Breakdown"), 3}, {Perk::no_effect, 0}}},
+                {ANCIENT, ARMOUR, 137, {{Perk::get("Biting"), 4}, {Perk::get("Mobile"), 1}}},
+        };
+    }
+
+    class BenchmarkRunner {
+    public:
+        BenchmarkRunner(std::chrono::nanoseconds min_time, std::string filter) :
+                min_time_(min_time), filter_(std::move(filter)) {}
+
+        // Time fn, which processes items_per_call items each time it is called.
+        template<typename F>
+        void run(const std::string &benchmark, const std::string &case_name, size_t items_per_call, F fn) {
+            if (!enabled(benchmark)) {
+                return;
+            }
+
+            // Warm up, then double the iterations until a run takes long enough to time reliably.
+            fn();
+            size_t iterations = 1;
+            std::chrono::nanoseconds elapsed;
+            while (true) {
+                auto start = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < iterations; ++i) {
+                    fn();
+                }
+                elapsed = std::chrono::steady_clock::now() - start;
+                if (elapsed >= min_time_) {
+                    break;
+                }
+                iterations *= 2;
+            }
+
+            size_t items = iterations * items_per_call;
+            std::cout << "{\"benchmark\": \"" << benchmark << "\""
+                      << ", \"case\": \"" << case_name << "\""
+                      << ", \"iterations\": " << iterations
+                      << ", \"items\": " << items
+                      << ", \"total_ns\": " << elapsed.count()
+                      << ", \"ns_per_item\": " << static_cast<double>(elapsed.count()) / items
+                      << "}" << std::endl;
+        }
+
+        [[nodiscard]] bool enabled(const std::string &benchmark) const {
+            return filter_.empty() || benchmark.find(filter_) != std::string::npos;
+        }
+
+    private:
+        std::chrono::nanoseconds min_time_;
+        std::string filter_;
+    };
+
+    void benchmarkKernels(BenchmarkRunner &runner) {
+        PDF small(40, 1.0 / 40);
+        PDF large(300, 1.0 / 300);
+        runner.run("convolve", "300x40", 1, [&] { keep(convolve(large, small)); });
+
+        // Nine slots of typical rolls, as in a full ancient gizmo.
+        std::vector<contribution_roll_t> rolls = {40, 33, 45, 32, 40, 45, 33, 40, 32};
+        runner.run("Pdf", "9 rolls", 1, [&] { keep(Pdf(rolls)); });
+        runner.run("Cdf", "9 rolls", 1, [&] { keep(Cdf(rolls)); });
+
+        for (GizmoType gizmo_type : {STANDARD, ANCIENT}) {
+            std::stringstream case_name;
+            case_name << gizmo_type << " 1-137";
+            runner.run("inventionBudgetCdf", case_name.str(), 137, [&] {
+                for (level_t level = 1; level <= 137; ++level) {
+                    keep(inventionBudgetCdf(level, gizmo_type));
+                }
+            });
+        }
+    }
+
+    void benchmarkCase(BenchmarkRunner &runner, const BenchmarkCase &bench_case, int thread_count,
+                       size_t sample_size) {
+        const char *case_benchmarks[] = {"candidateGizmos", "parallelCandidateGizmos", "perkRollCdf",
+                                         "perkRollCdfColdCache", "perkRankProbabilities",
+                                         "perkCombinationProbabilities", "gizmoResultProbabilities",
+                                         "targetPerkProbabilities",
+                                         "targetProbabilityUpperBound", "targetProbability", "search", "streamSearch",
+                                         "cachedSearch", "levelSweep"};
+        if (std::none_of(std::begin(case_benchmarks), std::end(case_benchmarks),
+                         [&](const char *benchmark) { return runner.enabled(benchmark); })) {
+            // Skip building the candidate list.
+            return;
+        }
+
+        std::string case_name = bench_case.name();
+        OptimalGizmoSearch search(bench_case.equipment_type, bench_case.gizmo_type, bench_case.target);
+
+        runner.run("candidateGizmos", case_name, 1, [&] { keep(search.build_candidate_list({}, 1)); });
+        if (thread_count > 1) {
+            runner.run("parallelCandidateGizmos", case_name, 1, [&] {
+                keep(search.build_candidate_list({}, thread_count));
+            });
+        }
+
+        // The per-gizmo stages are timed over candidates spread evenly through the enumeration order.
+        search.build_candidate_list({}, thread_count);
+        const std::vector<Gizmo> &candidates = GizmoBenchmarks::candidates(search);
+        std::vector<Gizmo> sample;
+        size_t stride = std::max<size_t>(1, candidates.size() / sample_size);
+        for (size_t i = 0; i < candidates.size() && sample.size() < sample_size; i += stride) {
+            sample.push_back(candidates[i]);
+        }
+
+        std::vector<std::vector<Perk>> insertion_orders;
+        // The pointers are only valid while roll_cdfs holds the CDFs, as the cache may evict them.
+        std::vector<std::vector<std::shared_ptr<const CDF>>> roll_cdfs;
+        std::vector<std::vector<const CDF *>> roll_cdf_pointers;
+        std::vector<PerkRankTable> rank_tables(sample.size());
+        for (size_t i = 0; i < sample.size(); ++i) {
+            insertion_orders.push_back(GizmoBenchmarks::perkInsertionOrder(sample[i]));
+            roll_cdfs.push_back(GizmoBenchmarks::perkRollCdf(sample[i]));
+            roll_cdf_pointers.push_back(cdfPointers(roll_cdfs[i]));
+            GizmoBenchmarks::perkRankProbabilities(sample[i], insertion_orders[i], roll_cdf_pointers[i],
+                                                   rank_tables[i]);
+        }
+        level_t level = bench_case.invention_level;
+        const GizmoResult &target = bench_case.target;
+
+        runner.run("perkRollCdf", case_name, sample.size(), [&] {
+            for (const Gizmo &gizmo : sample) {
+                keep(GizmoBenchmarks::perkRollCdf(gizmo));
+            }
+        });
+        // A pass over every candidate starting from an empty cache, as the first query for a target would see.
+        RollCdfCache &roll_cdf_cache = RollCdfCache::shared();
+        runner.run("perkRollCdfColdCache", case_name, candidates.size(), [&] {
+            roll_cdf_cache.clear();
+            for (const Gizmo &gizmo : candidates) {
+                keep(GizmoBenchmarks::perkRollCdf(gizmo));
+            }
+        });
+        if (runner.enabled("perkRollCdfColdCache")) {
+            std::cout << "{\"cache\": \"RollCdfCache\""
+                      << ", \"case\": \"" << case_name << "\""
+                      << ", \"hits\": " << roll_cdf_cache.hits()
+                      << ", \"misses\": " << roll_cdf_cache.misses()
+                      << ", \"entries\": " << roll_cdf_cache.entries()
+                      << ", \"bytes\": " << roll_cdf_cache.bytes()
+                      << "}" << std::endl;
+        }
+        runner.run("perkRankProbabilities", case_name, sample.size(), [&] {
+            PerkRankTable rank_probabilities;
+            for (size_t i = 0; i < sample.size(); ++i) {
+                GizmoBenchmarks::perkRankProbabilities(sample[i], insertion_orders[i], roll_cdf_pointers[i],
+                                                       rank_probabilities);
+                keep(rank_probabilities);
+            }
+        });
+        runner.run("perkCombinationProbabilities", case_name, sample.size(), [&] {
+            for (size_t i = 0; i < sample.size(); ++i) {
+                keep(GizmoBenchmarks::perkCombinationProbabilities(sample[i], rank_tables[i]));
+            }
+        });
+        runner.run("gizmoResultProbabilities", case_name, sample.size(), [&] {
+            for (const Gizmo &gizmo : sample) {
+                keep(gizmo.perkProbabilities(level));
+            }
+        });
+        runner.run("targetPerkProbabilities", case_name, sample.size(), [&] {
+            for (const Gizmo &gizmo : sample) {
+                keep(gizmo.targetPerkProbabilities(level, target));
+            }
+        });
+
+        // The search's own evaluation path, over the whole candidate list so the prefix state is used as it would be.
+        GizmoPrefixState prefix_state(bench_case.equipment_type, bench_case.gizmo_type);
+        const CDF &budget_cdf = inventionBudgetCdf(level, bench_case.gizmo_type);
+        runner.run("targetProbabilityUpperBound", case_name, candidates.size(), [&] {
+            for (const Gizmo &gizmo : candidates) {
+                prefix_state.assign(gizmo);
+                keep(gizmo.targetProbabilityUpperBound(budget_cdf, target, prefix_state));
+            }
+        });
+        runner.run("targetProbability", case_name, candidates.size(), [&] {
+            for (const Gizmo &gizmo : candidates) {
+                prefix_state.assign(gizmo);
+                keep(gizmo.targetProbability(budget_cdf, target, prefix_state));
+            }
+        });
+
+        runner.run("search", case_name, 1, [&] {
+            OptimalGizmoSearch full_search(bench_case.equipment_type, bench_case.gizmo_type, bench_case.target);
+            full_search.build_candidate_list({}, thread_count);
+            keep(full_search.results(level, thread_count, 16, 1));
+        });
+        runner.run("streamSearch", case_name, 1, [&] {
+            OptimalGizmoSearch full_search(bench_case.equipment_type, bench_case.gizmo_type, bench_case.target);
+            keep(full_search.streamResults({}, level, thread_count, 1024, 1));
+        });
+
+        // A search for a second target, one rank lower, after a search for the case's target has filled a
+        // distribution cache. Most of its candidates are shared, so they go straight to the budget step.
+        if (runner.enabled("cachedSearch")) {
+            DistributionCache distribution_cache;
+            OptimalGizmoSearch first_search(bench_case.equipment_type, bench_case.gizmo_type, bench_case.target);
+            first_search.useDistributionCache(&distribution_cache);
+            first_search.build_candidate_list({}, thread_count);
+            keep(first_search.results(level, thread_count, 16, 1));
+            size_t first_misses = distribution_cache.misses();
+
+            GizmoResult second_target = bench_case.target;
+            if (second_target.first.rank > 1) {
+                second_target = {{second_target.first.perk, static_cast<rank_t>(second_target.first.rank - 1)},
+                                 second_target.second};
+            }
+            bool first_run = true;
+            size_t second_hits = 0;
+            size_t second_misses = 0;
+            runner.run("cachedSearch", case_name, 1, [&] {
+                OptimalGizmoSearch second_search(bench_case.equipment_type, bench_case.gizmo_type, second_target);
+                second_search.useDistributionCache(&distribution_cache);
+                second_search.build_candidate_list({}, thread_count);
+                size_t hits_before = distribution_cache.hits();
+                size_t misses_before = distribution_cache.misses();
+                keep(second_search.results(level, thread_count, 16, 1));
+                if (first_run) {
+                    second_hits = distribution_cache.hits() - hits_before;
+                    second_misses = distribution_cache.misses() - misses_before;
+                    first_run = false;
+                }
+            });
+            std::cout << "{\"cache\": \"DistributionCache\""
+                      << ", \"case\": \"" << case_name << "\""
+                      << ", \"first_misses\": " << first_misses
+                      << ", \"second_hits\": " << second_hits
+                      << ", \"second_misses\": " << second_misses
+                      << ", \"entries\": " << distribution_cache.entries()
+                      << ", \"bytes\": " << distribution_cache.bytes()
+                      << "}" << std::endl;
+        }
+
+        // Every level from 1 to 137, timed per level.
+        std::vector<level_t> sweep_levels(137);
+        std::iota(sweep_levels.begin(), sweep_levels.end(), 1);
+        runner.run("levelSweep", case_name, sweep_levels.size(), [&] {
+            OptimalGizmoSearch full_search(bench_case.equipment_type, bench_case.gizmo_type, bench_case.target);
+            full_search.build_candidate_list({}, thread_count);
+            keep(full_search.levelSweepResults(sweep_levels, thread_count, 16, 1));
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+    // Options and defaults.
+    int thread_count = 1;
+    size_t min_time_ms = 200;
+    size_t sample_size = 256;
+    std::string filter;
+
+    for (size_t arg_idx = 0; arg_idx < args.size(); ++arg_idx) {
+        const std::string &token = args[arg_idx];
+        bool has_value = arg_idx + 1 < args.size();
+
+        if ((token == "-j" || token == "--threads") && has_value) {
+            thread_count = std::max(1, std::stoi(args[++arg_idx]));
+        } else if (token == "--min-time" && has_value) {
+            min_time_ms = std::stoul(args[++arg_idx]);
+        } else if (token == "--sample" && has_value) {
+            sample_size = std::max<size_t>(1, std::stoul(args[++arg_idx]));
+        } else if (token == "--filter" && has_value) {
+            filter = args[++arg_idx];
+        } else {
+            std::cerr << "Usage: gizmo-bench [-j threads] [--min-time ms] [--sample gizmos] [--filter benchmark]"
+                      << std::endl;
+            exit(1);
+        }
+    }
+
+    // Load configuration. Embedded data was registered before main.
+#ifndef RSPERKS_EMBED_DATA
+    Perk::registerPerks("../perkdata.csv");
+    Component::registerComponents("../compdata.csv");
+    Component::registerCosts("../compcost.csv");
+#endif
+
+    std::cout << "{\"simd\": \"" << rs::simd::instructionSet() << "\"}" << std::endl;
+    BenchmarkRunner runner(std::chrono::milliseconds(min_time_ms), filter);
+    benchmarkKernels(runner);
+    for (const BenchmarkCase &bench_case : benchmarkCorpus()) {
+        benchmarkCase(runner, bench_case, thread_count, sample_size);
+    }
+
+    return 0;
+}
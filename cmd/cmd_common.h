@@ -0,0 +1,42 @@
+//
+// Argument parsing helpers shared by the command line tools.
+//
+
+#ifndef RSPERKS_CMD_COMMON_H
+#define RSPERKS_CMD_COMMON_H
+
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <string>
+#include <vector>
+
+
+inline bool valid_number(const std::string &s) {
+    return !s.empty() &&
+           std::find_if(s.begin(), s.end(), [](unsigned char c) { return !std::isdigit(c); }) == s.end();
+}
+
+// Objects whose name starts with the search term, ignoring case.
+template<typename T>
+std::vector<T> search_filter_names(const std::vector<T> &objs, const std::string &search) {
+    // Use lowercase search term.
+    std::string lookup(search);
+    std::transform(search.begin(), search.end(), lookup.begin(), ::tolower);
+
+    std::vector<T> results;
+    std::copy_if(objs.begin(), objs.end(), std::back_inserter(results),
+                 [&lookup](const T &obj) {
+                     std::string obj_name(obj.name());
+                     // Convert name to lowercase.
+                     std::transform(obj_name.begin(), obj_name.end(), obj_name.begin(), ::tolower);
+                     // Check if lookup matches start of object name.
+                     return lookup.size() <= obj_name.size() &&
+                            std::equal(lookup.begin(), lookup.end(), obj_name.begin());
+                 });
+    return results;
+}
+
+
+#endif //RSPERKS_CMD_COMMON_H
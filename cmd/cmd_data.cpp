@@ -0,0 +1,138 @@
+//
+// Compiles the perk and component data files for the other tools: either into a data image, which they map at
+// startup instead of parsing the data files, or with --embed into a header of constant tables, for builds with
+// RSPERKS_EMBED_DATA.
+//
+// Usage: gizmo-data [--embed] perkdata.csv compdata.csv compcost.csv output
+//
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include "../rs/Component.h"
+#include "../rs/Perk.h"
+#include "../rs/DataImage.h"
+#include "../rs/ResultCache.h"
+
+
+std::string quoted(const std::string &value) {
+    std::string result = "\"";
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    return result + "\"";
+}
+
+// Lists the registered data as the tables rs/EmbeddedData.h builds on, in registration order.
+std::string embeddedTables(uint64_t data_hash) {
+    std::stringstream out;
+    out << "// Generated by gizmo-data from the data files. Do not edit." << std::endl
+        << std::endl
+        << "#ifndef RSPERKS_EMBEDDEDDATATABLES_H" << std::endl
+        << "#define RSPERKS_EMBEDDEDDATATABLES_H" << std::endl
+        << std::endl
+        << "namespace rs::embedded {" << std::endl
+        << "    constexpr uint64_t data_hash = 0x" << std::hex << std::setw(16) << std::setfill('0') << data_hash
+        << std::dec << "ull;" << std::endl
+        << std::endl;
+
+    std::vector<std::string> perk_lines;
+    std::vector<std::string> rank_lines;
+    for (const Perk &perk : Perk::all()) {
+        std::stringstream line;
+        line << "{" << unsigned(perk.id) << ", " << unsigned(perk.max_rank) << ", "
+             << (perk.twoSlot() ? "true" : "false") << ", " << quoted(perk.name()) << "}";
+        perk_lines.push_back(line.str());
+
+        for (const Rank &rank : perk.ranks()) {
+            if (rank.rank == 0) {
+                continue;
+            }
+            std::stringstream rank_line;
+            rank_line << "{" << unsigned(perk.id) << ", {" << unsigned(rank.rank) << ", " << unsigned(rank.cost) << ", "
+                      << rank.threshold << ", " << (rank.ancient ? "true" : "false") << "}}";
+            rank_lines.push_back(rank_line.str());
+        }
+    }
+
+    std::vector<std::string> component_lines;
+    std::vector<std::string> contribution_lines;
+    for (const Component &component : Component::all()) {
+        std::stringstream line;
+        line << "{" << unsigned(component.id) << ", " << quoted(component.name()) << ", " << component.cost() << ", "
+             << (component.ancient() ? "true" : "false") << ", " << unsigned(component.requiredLevel()) << ", {{";
+        for (size_t equipment = 0; equipment < EquipmentType::SIZE; ++equipment) {
+            const std::vector<PerkContribution> &contributions =
+                    component.perkContributions(static_cast<EquipmentType>(equipment));
+            line << (equipment ? ", " : "") << "{" << contribution_lines.size() << ", " << contributions.size() << "}";
+            for (const PerkContribution &contribution : contributions) {
+                std::stringstream contribution_line;
+                contribution_line << "{" << unsigned(contribution.perk.id) << ", " << unsigned(contribution.base)
+                                  << ", " << unsigned(contribution.roll) << "}";
+                contribution_lines.push_back(contribution_line.str());
+            }
+        }
+        line << "}}}";
+        component_lines.push_back(line.str());
+    }
+
+    auto table = [&out](const std::string &type, const std::string &name, const std::vector<std::string> &lines) {
+        out << "    constexpr std::array<" << type << ", " << lines.size() << "> " << name << " = {{" << std::endl;
+        for (const std::string &line : lines) {
+            out << "            " << line << "," << std::endl;
+        }
+        out << "    }};" << std::endl;
+    };
+    table("EmbeddedPerk", "perks", perk_lines);
+    out << std::endl;
+    table("EmbeddedRank", "perk_ranks", rank_lines);
+    out << std::endl;
+    table("EmbeddedComponent", "components", component_lines);
+    out << std::endl;
+    table("EmbeddedContribution", "contributions", contribution_lines);
+    out << "}" << std::endl
+        << std::endl
+        << "#endif //RSPERKS_EMBEDDEDDATATABLES_H" << std::endl;
+    return out.str();
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+    bool embed = !args.empty() && args[0] == "--embed";
+    if (embed) {
+        args.erase(args.begin());
+    }
+    if (args.size() != 4) {
+        std::cerr << "Usage: gizmo-data [--embed] perkdata.csv compdata.csv compcost.csv output" << std::endl;
+        exit(1);
+    }
+    const std::vector<std::string> data_files = {args[0], args[1], args[2]};
+    std::string output = args[3];
+
+    Perk::registerPerks(data_files[0]);
+    Component::registerComponents(data_files[1]);
+    Component::registerCosts(data_files[2]);
+    uint64_t data_hash = ResultCache::hashFiles(data_files);
+
+    if (embed) {
+        std::ofstream file(output, std::ios::trunc);
+        file << embeddedTables(data_hash);
+        if (!file.flush()) {
+            std::cerr << "[Error] Could not write embedded data tables: " << output << std::endl;
+            exit(1);
+        }
+    } else if (!DataImage::write(output, data_hash)) {
+        std::cerr << "[Error] Could not write data image: " << output << std::endl;
+        exit(1);
+    }
+    std::cout << "Wrote " << Perk::all().size() << " perks and " << Component::all().size() << " components to "
+              << output << std::endl;
+
+    return 0;
+}
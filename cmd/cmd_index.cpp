@@ -0,0 +1,155 @@
+//
+// Builds a gizmo index: every gizmo a search over a set of perks could consider, listed by the results it can roll,
+// so gizmo-search --index can answer queries over those perks with a lookup instead of a search.
+//
+// Usage: gizmo-index [-std | -anc] (-w | -t | -a) [-l level] [-j threads] [-p perk]... -o output
+//
+// Without any -p, every perk which the components usable at the level can give on the equipment is indexed.
+//
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <memory>
+#include "../rs/InventionTypes.h"
+#include "../rs/Component.h"
+#include "../rs/Perk.h"
+#include "../rs/GizmoIndex.h"
+#include "../rs/ResultCache.h"
+#include "../rs/DataImage.h"
+#ifdef RSPERKS_EMBED_DATA
+#include "../rs/EmbeddedData.h"
+#endif
+#include "cmd_common.h"
+
+
+void printUsage() {
+    std::cerr << "Usage: gizmo-index [-std | -anc] (-w | -t | -a) [-l level] [-j threads] [-p perk]... -o output"
+              << std::endl;
+}
+
+// Every perk some component usable at the level can give on the equipment.
+std::vector<Perk> possiblePerks(EquipmentType equipment_type, GizmoType gizmo_type, level_t invention_level) {
+    std::bitset<std::numeric_limits<perk_id_t>::max()> possible;
+    for (const Component &component : Component::all()) {
+        if (component == Component::empty || (gizmo_type != ANCIENT && component.ancient()) ||
+            component.requiredLevel() > invention_level) {
+            continue;
+        }
+        possible |= component.possiblePerkBitset(equipment_type);
+    }
+
+    std::vector<Perk> perks;
+    for (const Perk &perk : Perk::all()) {
+        if (perk.id != no_effect_id && possible.test(perk.id)) {
+            perks.push_back(perk);
+        }
+    }
+    return perks;
+}
+
+int main(int argc, char **argv) {
+    std::vector<std::string> args(argv + 1, argv + argc);
+
+#ifndef RSPERKS_EMBED_DATA
+    const std::vector<std::string> data_files = {"../perkdata.csv", "../compdata.csv", "../compcost.csv"};
+    const DataImage *data_image = DataImage::registerImage("gizmodata.bin");
+    if (!data_image) {
+        Perk::registerPerks(data_files[0]);
+        Component::registerComponents(data_files[1]);
+        Component::registerCosts(data_files[2]);
+    }
+    uint64_t data_hash = data_image ? data_image->dataHash() : ResultCache::hashFiles(data_files);
+#else
+    uint64_t data_hash = rs::embedded::data_hash;
+#endif
+
+    EquipmentType equipment_type = EquipmentType::SIZE;
+    GizmoType gizmo_type = STANDARD;
+    level_t invention_level = 120;
+    int thread_count = 1;
+    std::vector<Perk> perks;
+    std::string output;
+
+    for (size_t arg_idx = 0; arg_idx < args.size(); ++arg_idx) {
+        const std::string &token = args[arg_idx];
+        bool has_value = arg_idx + 1 < args.size();
+        if (token == "-w" || token == "--weapon") {
+            equipment_type = WEAPON;
+        } else if (token == "-t" || token == "--tool") {
+            equipment_type = TOOL;
+        } else if (token == "-a" || token == "--armour") {
+            equipment_type = ARMOUR;
+        } else if (token == "-std" || token == "--standard") {
+            gizmo_type = STANDARD;
+        } else if (token == "-anc" || token == "--ancient") {
+            gizmo_type = ANCIENT;
+        } else if (token == "-l" || token == "--level" || token == "-j" || token == "--threads") {
+            // Next token is the number to set.
+            if (!has_value || !valid_number(args[arg_idx + 1]) || args[arg_idx + 1].size() > 9) {
+                printUsage();
+                return 1;
+            }
+            int value = std::stoi(args[++arg_idx]);
+            bool level = token == "-l" || token == "--level";
+            if (value < 1 || (level && value > std::numeric_limits<level_t>::max())) {
+                printUsage();
+                return 1;
+            }
+            if (level) {
+                invention_level = value;
+            } else {
+                thread_count = value;
+            }
+        } else if ((token == "-o" || token == "--output") && has_value) {
+            output = args[++arg_idx];
+        } else if ((token == "-p" || token == "--perk") && has_value) {
+            // The perk name runs up to the next token starting with a '-'.
+            std::string name;
+            while (arg_idx + 1 < args.size() && args[arg_idx + 1][0] != '-') {
+                name += (name.empty() ? "" : " ") + args[++arg_idx];
+            }
+            std::vector<Perk> matches = search_filter_names(Perk::all(), name);
+            if (matches.size() != 1) {
+                std::cerr << "[Error] Perk '" << name << "' "
+                          << (matches.empty() ? "could not be found." : "is ambiguous.") << std::endl;
+                return 2;
+            }
+            if (std::find(perks.begin(), perks.end(), matches[0]) == perks.end()) {
+                perks.push_back(matches[0]);
+            }
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+    if (equipment_type == EquipmentType::SIZE || output.empty()) {
+        printUsage();
+        return 1;
+    }
+    if (perks.empty()) {
+        perks = possiblePerks(equipment_type, gizmo_type, invention_level);
+    }
+
+    std::cout << "Indexing " << perks.size() << " perks for " << gizmo_type << " " << equipment_type
+              << " gizmos at level " << unsigned(invention_level) << "..." << std::endl;
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!GizmoIndex::build(output, equipment_type, gizmo_type, invention_level, perks, data_hash, thread_count)) {
+        std::cerr << "[Error] Could not write " << output << std::endl;
+        return 1;
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::unique_ptr<GizmoIndex> index = GizmoIndex::open(output);
+    if (!index) {
+        std::cerr << "[Error] Could not read back " << output << std::endl;
+        return 1;
+    }
+    std::cout << "Indexed " << index->gizmoCount() << " gizmos, " << index->resultCount() << " results and "
+              << index->entryCount() << " entries in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms." << std::endl;
+    return 0;
+}
@@ -8,13 +8,29 @@
 #include <algorithm>
 #include <numeric>
 #include <iomanip>
+#include <sstream>
 #include <chrono>
+#include <atomic>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include "../rs/InventionTypes.h"
 #include "../rs/Component.h"
 #include "../rs/Perk.h"
 #include "../rs/Gizmo.h"
 #include "../rs/OptimalGizmoSearch.h"
+#include "../rs/DistributionCache.h"
+#include "../rs/AllocationCounter.h"
+#include "../rs/ResultCache.h"
+#include "../rs/DataImage.h"
+#include "../rs/GizmoIndex.h"
+#ifdef RSPERKS_EMBED_DATA
+#include "../rs/EmbeddedData.h"
+#endif
+#include "cmd_common.h"
 
 #define REL_VERSION "1.0"
 
@@ -29,27 +45,46 @@ void printUsage() {
     std::cout << "No usage information yet :(" << std::endl;
 }
 
-bool valid_number(const std::string &s) {
-    return !s.empty() &&
-           std::find_if(s.begin(), s.end(), [](unsigned char c) { return !std::isdigit(c); }) == s.end();
+// Parse a list of invention levels such as "1-137" or "90,99,110-120".
+std::vector<level_t> parse_levels(const std::string &spec) {
+    std::vector<level_t> levels;
+    std::stringstream spec_stream(spec);
+    std::string part;
+    while (std::getline(spec_stream, part, ',')) {
+        size_t dash = part.find('-');
+        std::string first = part.substr(0, dash);
+        std::string last = dash == std::string::npos ? first : part.substr(dash + 1);
+        if (!valid_number(first) || !valid_number(last) || std::stoi(first) < 1 || std::stoi(last) > 255 ||
+            std::stoi(first) > std::stoi(last)) {
+            std::cout << "[Error] Invalid invention levels '" << part << "'." << std::endl;
+            exit(2);
+        }
+        for (int level = std::stoi(first); level <= std::stoi(last); ++level) {
+            levels.push_back(level);
+        }
+    }
+
+    std::sort(levels.begin(), levels.end());
+    levels.erase(std::unique(levels.begin(), levels.end()), levels.end());
+    return levels;
 }
 
-template<typename T>
-std::vector<T> search_filter_names(const std::vector<T> &objs, const std::string &search) {
-    // Use lowercase search term.
-    std::string lookup(search);
-    std::transform(search.begin(), search.end(), lookup.begin(), ::tolower);
-
-    std::vector<T> results;
-    std::copy_if(objs.begin(), objs.end(), std::back_inserter(results),
-                 [&lookup](const T &obj) {
-                     std::string obj_name(obj.name());
-                     // Convert name to lowercase.
-                     std::transform(obj_name.begin(), obj_name.end(), obj_name.begin(), ::tolower);
-                     // Check if lookup matches start of object name.
-                     return std::equal(lookup.begin(), lookup.end(), obj_name.begin());
-                 });
-    return results;
+// The levels as parse_levels would accept them, with runs of consecutive levels written as ranges.
+std::string format_levels(const std::vector<level_t> &levels) {
+    std::stringstream formatted;
+    size_t run_start = 0;
+    while (run_start < levels.size()) {
+        size_t run_end = run_start + 1;
+        while (run_end < levels.size() && levels[run_end] == levels[run_end - 1] + 1) {
+            ++run_end;
+        }
+        formatted << (run_start == 0 ? "" : ", ") << unsigned(levels[run_start]);
+        if (run_end - run_start > 1) {
+            formatted << "-" << unsigned(levels[run_end - 1]);
+        }
+        run_start = run_end;
+    }
+    return formatted.str();
 }
 
 void printProgress(OptimalGizmoSearch *const obj) {
@@ -65,34 +100,23 @@ void printProgress(OptimalGizmoSearch *const obj) {
     }
 }
 
-int main(int argc, char **argv) {
-    // Read arguments.
-    std::vector<std::string> args;
-    if (argc == 1) {
-        std::cout << "No arguments provided." << std::endl;
-        printUsage();
-        exit(1);
+void printStreamProgress(OptimalGizmoSearch *const obj) {
+    // The total is not known up front when streaming, so just report how far we have got.
+    while (!obj->searchComplete()) {
+        std::cout << "\33[2K\rProgress: Generated " << obj->total_candidates
+                  << ", searched " << obj->resultsSearched()
+                  << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
     }
-    args.assign(argv + 1, argv + argc);
-
-    // Print welcome.
-    std::cout << "Optimal Gizmo Search Tool (" << REL_VERSION << ") by AJLogan (github.com/ajlogan1/RsOptimalGizmo)"
-              << std::endl;
-    std::cout << "  " << "Built with " << true_cxx << " version " << __VERSION__ << " on " << __DATE__ << " "
-              << __TIME__ << std::endl;
-
-    // Load configuration.
-    Perk::registerPerks("../perkdata.csv");
-    Component::registerComponents("../compdata.csv");
-    Component::registerCosts("../compcost.csv");
+}
 
-    // Options and defaults.
-    EquipmentType equipment_type;
+// Options making up one query, from the command line or from one line of a batch.
+struct QueryOptions {
+    EquipmentType equipment_type = EquipmentType::SIZE;
     GizmoType gizmo_type = STANDARD;
     level_t invention_level = 120;
-    bool strict_target = true;
     size_t max_results = 1;
-    int thread_count = 1;
+    SearchObjective objective = MAX_PROBABILITY;
     std::vector<Component> excluded_components;
 
     // Targets.
@@ -101,162 +125,668 @@ int main(int argc, char **argv) {
     Perk target_2 = Perk::no_effect;
     rank_t target_2_rank = 0;
 
-    // Parse arguments and fill options.
-    size_t arg_idx = 0;
-    while (arg_idx < args.size()) {
-        std::string &token = args[arg_idx];
+    [[nodiscard]] GizmoResult target() const {
+        return GizmoResult({target_1, target_1_rank}, {target_2, target_2_rank});
+    }
+
+    [[nodiscard]] ResultCacheQuery query() const {
+        return ResultCacheQuery{equipment_type, gizmo_type, invention_level, target(), excluded_components, objective,
+                                max_results};
+    }
+};
+
+enum class OptionParse {
+    NOT_QUERY_OPTION, PARSED, INVALID
+};
+
+// The name given to -p or -x: every token up to the next one which starts with a '-'. Leaves arg_idx on its last token.
+std::vector<std::string> name_tokens(const std::vector<std::string> &args, size_t &arg_idx) {
+    std::vector<std::string> tokens;
+    while (arg_idx + 1 < args.size() && args[arg_idx + 1][0] != '-') {
+        tokens.push_back(args[++arg_idx]);
+    }
+    return tokens;
+}
+
+std::string join_tokens(std::vector<std::string>::const_iterator begin, std::vector<std::string>::const_iterator end) {
+    return std::accumulate(begin, end, std::string(), [](const std::string &acc, const std::string &token) {
+        return acc + (acc.length() > 0 ? " " : "") + token;
+    });
+}
+
+// Finds the one perk or component whose name starts with the given one. kind names it in errors.
+template<typename T>
+bool find_by_name(const std::vector<T> &objs, const std::string &name, const std::string &kind, T &found,
+                  std::string &error) {
+    std::vector<T> search_results = search_filter_names(objs, name);
+    if (search_results.empty()) {
+        error = kind + " '" + name + "' could not be found.";
+        return false;
+    }
+    if (search_results.size() > 1) {
+        error = kind + " '" + name + "' is ambiguous. Could be one of: \n";
+        for (const T &result : search_results) {
+            error += "    " + result.name() + "\n";
+        }
+        error += "Please specify one of these.";
+        return false;
+    }
+    found = search_results[0];
+    return true;
+}
+
+// Reads the query option starting at args[arg_idx] into options, leaving arg_idx on its last token. Anything else is
+// left for the caller. Options which are given but cannot be used are INVALID, explained in error.
+OptionParse parse_query_option(const std::vector<std::string> &args, size_t &arg_idx, QueryOptions &options,
+                               std::string &error) {
+    const std::string &token = args[arg_idx];
+
+    // Setting - Equipment Type
+    if (token == "-w" || token == "--weapon") {
+        options.equipment_type = WEAPON;
+    } else if (token == "-t" || token == "--tool") {
+        options.equipment_type = TOOL;
+    } else if (token == "-a" || token == "--armour") {
+        options.equipment_type = ARMOUR;
+    }
+
+    // Setting - Gizmo Type
+    else if (token == "-std" || token == "--standard") {
+        options.gizmo_type = STANDARD;
+    } else if (token == "-anc" || token == "--ancient") {
+        options.gizmo_type = ANCIENT;
+    }
+
+    // Setting - Search objective
+    else if (token == "-c" || token == "--cost") {
+        options.objective = MIN_EXPECTED_COST;
+    }
 
-        // Setting - Equipment Type
-        if (token == "-w" || token == "--weapon") {
-            equipment_type = WEAPON;
+    // Setting - Invention Level and Max Results
+    else if (token == "-l" || token == "--level" || token == "-n" || token == "--num-results") {
+        // Next token is the number to set.
+        if (arg_idx + 1 >= args.size() || !valid_number(args[arg_idx + 1]) || args[arg_idx + 1].size() > 9) {
+            error = "Expected a number after " + token + ".";
+            return OptionParse::INVALID;
         }
-        if (token == "-t" || token == "--tool") {
-            equipment_type = TOOL;
+        int value = std::stoi(args[++arg_idx]);
+        if (token == "-n" || token == "--num-results") {
+            options.max_results = value;
+        } else if (value < 1 || value > std::numeric_limits<level_t>::max()) {
+            error = "Invalid invention level '" + args[arg_idx] + "'.";
+            return OptionParse::INVALID;
+        } else {
+            options.invention_level = value;
         }
-        if (token == "-a" || token == "--armour") {
-            equipment_type = ARMOUR;
+    }
+
+    // Target Perks
+    else if (token == "-p" || token == "--target") {
+        std::vector<std::string> target_tokens = name_tokens(args, arg_idx);
+        if (target_tokens.empty()) {
+            error = "Expected a perk after " + token + ".";
+            return OptionParse::INVALID;
         }
+        rank_t target_rank = 1;
 
-        // Setting - Gizmo Type
-        if (token == "-std" || token == "--standard") {
-            gizmo_type = STANDARD;
+        // If the last number in the target tokens is a number, interpret it as the rank.
+        bool rank_specified = false;
+        if (valid_number(target_tokens.back()) && target_tokens.back().size() <= 3) {
+            target_rank = std::stoi(target_tokens.back());
+            rank_specified = true;
         }
-        if (token == "-anc" || token == "--ancient") {
-            gizmo_type = ANCIENT;
+
+        // Build perk name from other tokens, and search for it.
+        std::string target_name = join_tokens(target_tokens.begin(), target_tokens.end() - (rank_specified ? 1 : 0));
+        Perk target_perk = Perk::no_effect;
+        if (!find_by_name(Perk::all(), target_name, "Perk", target_perk, error)) {
+            return OptionParse::INVALID;
         }
 
-        // Setting - Invention Level
-        if (token == "-l" || token == "--level") {
-            // Next token is level to set.
-            arg_idx++;
-            std::string &lvl_token = args[arg_idx];
-            invention_level = std::stoi(lvl_token);
+        // Set the perks.
+        if (options.target_1 == Perk::no_effect) {
+            options.target_1 = target_perk;
+            options.target_1_rank = target_rank;
+        } else if (options.target_2 == Perk::no_effect) {
+            options.target_2 = target_perk;
+            options.target_2_rank = target_rank;
+        } else {
+            error = "You can only specify up to two perks to search for.";
+            return OptionParse::INVALID;
         }
+    }
 
-        // Setting - Max Results
-        if (token == "-n" || token == "--num-results") {
-            // Next token is number of results.
+    // Excluded components.
+    else if (token == "-x" || token == "--exclude") {
+        std::vector<std::string> component_tokens = name_tokens(args, arg_idx);
+        if (component_tokens.empty()) {
+            error = "Expected a component after " + token + ".";
+            return OptionParse::INVALID;
+        }
+        Component component = Component::empty;
+        if (!find_by_name(Component::all(), join_tokens(component_tokens.begin(), component_tokens.end()),
+                          "Component", component, error)) {
+            return OptionParse::INVALID;
+        }
+        options.excluded_components.push_back(component);
+    } else {
+        return OptionParse::NOT_QUERY_OPTION;
+    }
+
+    return OptionParse::PARSED;
+}
+
+// Parses the count after a flag such as -j, which must be at least 1.
+bool parse_count(const std::vector<std::string> &args, size_t &arg_idx, int &count, std::string &error) {
+    const std::string &token = args[arg_idx];
+    if (arg_idx + 1 >= args.size() || !valid_number(args[arg_idx + 1]) || args[arg_idx + 1].size() > 9 ||
+        std::stoi(args[arg_idx + 1]) < 1) {
+        error = "Expected a number of at least 1 after " + token + ".";
+        return false;
+    }
+    count = std::stoi(args[++arg_idx]);
+    return true;
+}
+
+// Parses the value after a flag such as -L.
+bool parse_value(const std::vector<std::string> &args, size_t &arg_idx, std::string &value, std::string &error) {
+    if (arg_idx + 1 >= args.size()) {
+        error = "Expected a value after " + args[arg_idx] + ".";
+        return false;
+    }
+    value = args[++arg_idx];
+    return true;
+}
+
+bool valid_query(const QueryOptions &options, std::string &error) {
+    if (options.equipment_type == EquipmentType::SIZE) {
+        error = "An equipment type must be given, with -w, -t or -a.";
+        return false;
+    }
+    if (options.target_1 == Perk::no_effect) {
+        error = "At least one target perk must be given, with -p.";
+        return false;
+    }
+    return true;
+}
+
+// Whether an index can answer a query: it was built for the same gizmos, level and data, and covers the target.
+bool index_answers(const GizmoIndex &index, const ResultCacheQuery &query, uint64_t data_hash) {
+    return index.equipmentType() == query.equipment_type && index.gizmoType() == query.gizmo_type &&
+           index.inventionLevel() == query.invention_level && index.dataHash() == data_hash &&
+           index.covers(query.target);
+}
+
+// The best results for a query from an index. The results point into gizmos, which must outlive them.
+std::vector<GizmoTargetProbability> index_results(const GizmoIndex &index, const ResultCacheQuery &query,
+                                                  std::deque<Gizmo> &gizmos) {
+    // Entries are best first, so when ranking by probability alone the rest can be skipped as soon as one falls below
+    // the results kept.
+    TopResults top(query.max_results, query.objective);
+    for (const GizmoIndex::EntryRecord &entry : index.results(query.target)) {
+        if (query.objective == MAX_PROBABILITY && entry.probability < top.threshold()) {
+            break;
+        }
+        Gizmo gizmo = index.gizmo(entry);
+        bool uses_excluded = std::any_of(gizmo.begin(), gizmo.end(), [&](const Component &component) {
+            return std::find(query.excluded.begin(), query.excluded.end(), component) != query.excluded.end();
+        });
+        if (uses_excluded || !top.accepts({&gizmo, entry.probability})) {
+            continue;
+        }
+        gizmos.push_back(gizmo);
+        top.offer({&gizmos.back(), entry.probability});
+    }
+    std::vector<TopResults> parts = {top};
+    return TopResults::merge(parts, query.max_results, query.objective);
+}
+
+enum BatchFormat {
+    BATCH_JSON, BATCH_CSV
+};
+
+// One line of a batch.
+struct BatchQuery {
+    size_t line_number;
+    std::string line;
+    QueryOptions options;
+    // Set if the line is not a valid query.
+    std::string error;
+};
+
+std::string json_string(const std::string &value) {
+    std::stringstream out;
+    out << '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c == '\n') {
+            out << "\\n";
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << int(c) << std::dec << std::setfill(' ');
+        } else {
+            out << c;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+std::string csv_field(const std::string &value) {
+    if (value.find_first_of(",\"\n") == std::string::npos) {
+        return value;
+    }
+    std::string quoted = "\"";
+    for (char c : value) {
+        quoted += c == '"' ? "\"\"" : std::string(1, c);
+    }
+    return quoted + "\"";
+}
+
+// Formats the outcome of one batch query as a single line. source is empty if the query was not valid.
+std::string batch_line(const BatchQuery &query, BatchFormat format, const std::string &source, int64_t microseconds,
+                       size_t candidates, const std::vector<GizmoTargetProbability> &results) {
+    std::vector<std::string> probabilities;
+    std::vector<std::string> expected_costs;
+    std::vector<std::vector<std::string>> components;
+    for (const GizmoTargetProbability &result : results) {
+        std::stringstream probability;
+        probability << std::setprecision(std::numeric_limits<probability_t>::max_digits10) << result.target_probability;
+        probabilities.push_back(probability.str());
+        expected_costs.push_back(std::to_string(
+                static_cast<size_t>(static_cast<float>(result.cost) / result.target_probability)));
+        components.emplace_back();
+        for (size_t i = 0; i < slotsForType(result.gizmo->type()); ++i) {
+            components.back().push_back(result.gizmo->components()[i].name());
+        }
+    }
+
+    std::stringstream line;
+    if (format == BATCH_CSV) {
+        auto joined = [](const std::vector<std::string> &values, const std::string &separator) {
+            std::string out;
+            for (size_t i = 0; i < values.size(); ++i) {
+                out += (i > 0 ? separator : "") + values[i];
+            }
+            return out;
+        };
+        std::vector<std::string> gizmos;
+        for (const std::vector<std::string> &gizmo_components : components) {
+            gizmos.push_back(joined(gizmo_components, "+"));
+        }
+        line << query.line_number << "," << csv_field(query.line) << "," << (source.empty() ? "error" : "ok") << ","
+             << source << "," << microseconds << "," << candidates << "," << joined(probabilities, ";") << ","
+             << joined(expected_costs, ";") << "," << csv_field(joined(gizmos, ";")) << ","
+             << csv_field(query.error);
+        return line.str();
+    }
+
+    line << "{\"line\": " << query.line_number
+         << ", \"query\": " << json_string(query.line)
+         << ", \"status\": \"" << (source.empty() ? "error" : "ok") << "\"";
+    if (source.empty()) {
+        line << ", \"error\": " << json_string(query.error) << ", \"microseconds\": " << microseconds << "}";
+        return line.str();
+    }
+    line << ", \"source\": \"" << source << "\""
+         << ", \"microseconds\": " << microseconds
+         << ", \"candidates\": " << candidates
+         << ", \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        line << (i > 0 ? ", " : "") << "{\"probability\": " << probabilities[i]
+             << ", \"expected_cost\": " << expected_costs[i] << ", \"components\": [";
+        for (size_t slot = 0; slot < components[i].size(); ++slot) {
+            line << (slot > 0 ? ", " : "") << json_string(components[i][slot]);
+        }
+        line << "]}";
+    }
+    line << "]}";
+    return line.str();
+}
+
+// Answers one batch query on the calling thread, from the cache, the index or a search, in that order of preference.
+std::string run_batch_query(const BatchQuery &query, BatchFormat format, const ResultCache *cache,
+                            const GizmoIndex *index, uint64_t data_hash) {
+    auto start = std::chrono::high_resolution_clock::now();
+    std::string source;
+    size_t candidates = 0;
+    std::vector<GizmoTargetProbability> results;
+    // Whichever of these the results point into.
+    std::vector<CachedResult> cached_results;
+    std::deque<Gizmo> index_gizmos;
+    std::unique_ptr<OptimalGizmoSearch> search;
+
+    if (query.error.empty()) {
+        const QueryOptions &options = query.options;
+        ResultCacheQuery search_query = options.query();
+        if (cache && cache->load(search_query, cached_results)) {
+            source = "cache";
+            for (const CachedResult &cached : cached_results) {
+                results.emplace_back(&cached.gizmo, cached.target_probability);
+            }
+        } else if (index && index_answers(*index, search_query, data_hash)) {
+            source = "index";
+            results = index_results(*index, search_query, index_gizmos);
+        } else {
+            // Queries run side by side, so each search has one thread, and they share their candidates' distributions.
+            source = "search";
+            search = std::make_unique<OptimalGizmoSearch>(options.equipment_type, options.gizmo_type,
+                                                          search_query.target, options.objective);
+            search->useDistributionCache(&DistributionCache::shared());
+            candidates = search->build_candidate_list(options.excluded_components, 1, options.invention_level);
+            results = search->results(options.invention_level, 1, 16, options.max_results);
+            if (cache) {
+                cache->store(search_query, results);
+            }
+        }
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    return batch_line(query, format, source, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+                      candidates, results);
+}
+
+// Runs every query in a file, or stdin for "-", one per line in the same form as the command line, e.g.
+// "-anc -a -l 137 -p Biting 4 -p Mobile -x Subtle". Blank lines and lines starting with '#' are skipped.
+// Queries are shared out between thread_count threads, and a line for each is written to stdout in input order.
+// Returns the exit code: non-zero if the file could not be read or any query was not valid.
+int run_batch(const std::string &path, BatchFormat format, int thread_count, const ResultCache *cache,
+              const GizmoIndex *index, uint64_t data_hash) {
+    std::ifstream file;
+    std::istream *input = &std::cin;
+    if (path != "-") {
+        file.open(path);
+        if (!file) {
+            std::cerr << "[Error] Could not open batch file " << path << std::endl;
+            return 2;
+        }
+        input = &file;
+    }
+
+    std::vector<BatchQuery> queries;
+    size_t invalid_queries = 0;
+    std::string line;
+    for (size_t line_number = 1; std::getline(*input, line); ++line_number) {
+        std::vector<std::string> tokens;
+        std::stringstream line_stream(line);
+        for (std::string token; line_stream >> token;) {
+            tokens.push_back(token);
+        }
+        if (tokens.empty() || tokens[0][0] == '#') {
+            continue;
+        }
+
+        BatchQuery query{line_number, line, {}, ""};
+        for (size_t arg_idx = 0; arg_idx < tokens.size() && query.error.empty(); ++arg_idx) {
+            if (parse_query_option(tokens, arg_idx, query.options, query.error) == OptionParse::NOT_QUERY_OPTION) {
+                query.error = "Unknown option '" + tokens[arg_idx] + "'.";
+            }
+        }
+        if (query.error.empty()) {
+            valid_query(query.options, query.error);
+        }
+        invalid_queries += query.error.empty() ? 0 : 1;
+        queries.push_back(std::move(query));
+    }
+
+    if (format == BATCH_CSV) {
+        std::cout << "line,query,status,source,microseconds,candidates,probabilities,expected_costs,gizmos,error"
+                  << std::endl;
+    }
+
+    // Lines are written as soon as every query before them is done, so the output is in input order.
+    std::vector<std::string> outputs(queries.size());
+    std::vector<bool> done(queries.size(), false);
+    size_t next_output = 0;
+    std::mutex output_mutex;
+    std::atomic<size_t> next_query(0);
+    auto run = [&]() {
+        for (size_t i = next_query++; i < queries.size(); i = next_query++) {
+            std::string output = run_batch_query(queries[i], format, cache, index, data_hash);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            outputs[i] = std::move(output);
+            done[i] = true;
+            for (; next_output < queries.size() && done[next_output]; ++next_output) {
+                std::cout << outputs[next_output] << "\n";
+                outputs[next_output].clear();
+            }
+            std::cout << std::flush;
+        }
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(run);
+    }
+    run();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cerr << "Ran " << queries.size() << " queries (" << invalid_queries << " not valid) in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count() << "ms on "
+              << std::max(thread_count, 1) << " threads. Distribution cache: " << DistributionCache::shared().hits()
+              << " hits, " << DistributionCache::shared().misses() << " misses." << std::endl;
+    return invalid_queries > 0 ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    // Read arguments.
+    std::vector<std::string> args;
+    if (argc == 1) {
+        std::cout << "No arguments provided." << std::endl;
+        printUsage();
+        exit(1);
+    }
+    args.assign(argv + 1, argv + argc);
+
+    // Print welcome. Batches write their results to stdout, so it goes to stderr for them.
+    bool batch = std::find(args.begin(), args.end(), "--batch") != args.end();
+    std::ostream &welcome = batch ? std::cerr : std::cout;
+    welcome << "Optimal Gizmo Search Tool (" << REL_VERSION << ") by AJLogan (github.com/ajlogan1/RsOptimalGizmo)"
+            << std::endl;
+    welcome << "  " << "Built with " << true_cxx << " version " << __VERSION__ << " on " << __DATE__ << " "
+            << __TIME__ << std::endl;
+
+    // Load configuration, from the data image built alongside the tool if there is one. Embedded data needs no
+    // loading, having been registered before main.
+#ifndef RSPERKS_EMBED_DATA
+    const std::vector<std::string> data_files = {"../perkdata.csv", "../compdata.csv", "../compcost.csv"};
+    const DataImage *data_image = DataImage::registerImage("gizmodata.bin");
+    if (!data_image) {
+        Perk::registerPerks(data_files[0]);
+        Component::registerComponents(data_files[1]);
+        Component::registerCosts(data_files[2]);
+    }
+#endif
+    // Identifies the data, for checking cached results and indexes were worked out from the same.
+    auto data_hash = [&]() {
+#ifdef RSPERKS_EMBED_DATA
+        return rs::embedded::data_hash;
+#else
+        return data_image ? data_image->dataHash() : ResultCache::hashFiles(data_files);
+#endif
+    };
+
+    // Options and defaults.
+    QueryOptions options;
+    bool strict_target = true;
+    int thread_count = 1;
+    size_t grain_size = 16;
+    bool stream = false;
+    size_t batch_size = 1024;
+    std::vector<level_t> sweep_levels;
+    std::string cache_directory;
+    std::string index_path;
+    std::string batch_path;
+    BatchFormat batch_format = BATCH_JSON;
+
+    // Parse arguments and fill options.
+    size_t arg_idx = 0;
+    while (arg_idx < args.size()) {
+        std::string &token = args[arg_idx];
+
+        std::string error;
+        OptionParse parsed = parse_query_option(args, arg_idx, options, error);
+        if (parsed == OptionParse::INVALID) {
+            std::cout << "[Error] " << error << std::endl;
+            exit(2);
+        }
+        if (parsed == OptionParse::PARSED) {
             arg_idx++;
-            std::string &num_token = args[arg_idx];
-            max_results = std::stoi(num_token);
+            continue;
+        }
+
+        // Setting - Invention level sweep
+        if (token == "-L" || token == "--levels") {
+            // Next token is the list of levels to sweep.
+            std::string levels;
+            if (!parse_value(args, arg_idx, levels, error)) {
+                std::cout << "[Error] " << error << std::endl;
+                exit(2);
+            }
+            sweep_levels = parse_levels(levels);
         }
 
         // Setting - Concurrent threads
         if (token == "-j" || token == "--threads") {
             // Next token is number of threads.
-            arg_idx++;
-            std::string &num_token = args[arg_idx];
-            thread_count = std::stoi(num_token);
+            if (!parse_count(args, arg_idx, thread_count, error)) {
+                std::cout << "[Error] " << error << std::endl;
+                exit(2);
+            }
         }
 
-        // Target Perks
-        if (token == "-p" || token == "--target") {
-            // We read until we reach another token which starts with a '-'.
-            arg_idx++;
-            std::vector<std::string> target_tokens;
-            while (arg_idx < args.size() && args[arg_idx][0] != '-') {
-                target_tokens.push_back(args[arg_idx]);
-                arg_idx++;
-            }
-            arg_idx--;
-            rank_t target_rank = 1;
-
-            // If the last number in the target tokens is a number, interpret it as the rank.
-            bool rank_specified = false;
-            if (valid_number(target_tokens[target_tokens.size() - 1])) {
-                target_rank = std::stoi(target_tokens[target_tokens.size() - 1]);
-                rank_specified = true;
+        // Setting - Scheduling grain size
+        if (token == "-g" || token == "--grain") {
+            // Next token is number of candidates claimed at a time.
+            int count;
+            if (!parse_count(args, arg_idx, count, error)) {
+                std::cout << "[Error] " << error << std::endl;
+                exit(2);
             }
+            grain_size = count;
+        }
+
+        // Setting - Streaming search
+        if (token == "-s" || token == "--stream") {
+            stream = true;
+        }
 
-            // Build perk name from other tokens.
-            std::string target_name = std::accumulate(target_tokens.begin(),
-                                                      target_tokens.end() - (rank_specified ? 1 : 0),
-                                                      std::string(),
-                                                      [](const std::string &acc, const std::string &token) {
-                                                          return acc + (acc.length() > 0 ? " " : "") + token;
-                                                      });
-
-            // Search for target perks.
-            std::vector<Perk> perk_search_results = search_filter_names(Perk::all(), target_name);
-            if (perk_search_results.size() == 0) {
-                std::cout << "[Error] Perk '" << target_name << "' could not be found." << std::endl;
+        // Setting - Streaming batch size
+        if (token == "--batch-size") {
+            // Next token is number of candidates per batch.
+            int count;
+            if (!parse_count(args, arg_idx, count, error)) {
+                std::cout << "[Error] " << error << std::endl;
                 exit(2);
             }
-            if (perk_search_results.size() > 1) {
-                std::cout << "[Error] Perk '" << target_name << "' is ambiguous. Could be one of: " << std::endl;
-                for (Perk result : perk_search_results) {
-                    std::cout << "    " << result.name() << std::endl;
-                }
-                std::cout << "Please specify one of these." << std::endl;
+            batch_size = count;
+        }
+
+        // Setting - Result cache
+        if (token == "--cache") {
+            // Next token is the directory to keep cached results in.
+            if (!parse_value(args, arg_idx, cache_directory, error)) {
+                std::cout << "[Error] " << error << std::endl;
                 exit(2);
             }
+        }
 
-            Perk target_perk = perk_search_results[0];
-
-            // Set the perks.
-            if (target_1 == Perk::no_effect) {
-                target_1 = target_perk;
-                target_1_rank = target_rank;
-            } else if (target_2 == Perk::no_effect) {
-                target_2 = target_perk;
-                target_2_rank = target_rank;
-            } else {
-                std::cout << "[Error] You can only specify up to two perks to search for." << std::endl;
+        // Setting - Gizmo index
+        if (token == "--index") {
+            // Next token is the index file built by gizmo-index.
+            if (!parse_value(args, arg_idx, index_path, error)) {
+                std::cout << "[Error] " << error << std::endl;
                 exit(2);
             }
         }
 
-        // Excluded components.
-        if (token == "-x" || token == "--exclude") {
-            // We read until we reach another token which starts with a '-'.
-            arg_idx++;
-            std::vector<std::string> target_tokens;
-            while (arg_idx < args.size() && args[arg_idx][0] != '-') {
-                target_tokens.push_back(args[arg_idx]);
-                arg_idx++;
+        // Setting - Batch of queries
+        if (token == "--batch") {
+            // Next token is the file of queries, or - for stdin.
+            if (!parse_value(args, arg_idx, batch_path, error)) {
+                std::cout << "[Error] " << error << std::endl;
+                exit(2);
             }
-            arg_idx--;
-            rank_t target_rank = 1;
-
-            // Build component name from other tokens.
-            std::string target_name = std::accumulate(target_tokens.begin(),
-                                                      target_tokens.end(),
-                                                      std::string(),
-                                                      [](const std::string &acc, const std::string &token) {
-                                                          return acc + (acc.length() > 0 ? " " : "") + token;
-                                                      });
-
-            // Search for target perks.
-            std::vector<Component> component_search_results = search_filter_names(Component::all(), target_name);
-            if (component_search_results.size() == 0) {
-                std::cout << "[Error] Component '" << target_name << "' could not be found." << std::endl;
+        }
+
+        // Setting - Batch output format
+        if (token == "--format") {
+            std::string format;
+            if (!parse_value(args, arg_idx, format, error)) {
+                std::cout << "[Error] " << error << std::endl;
                 exit(2);
             }
-            if (component_search_results.size() > 1) {
-                std::cout << "[Error] Component '" << target_name << "' is ambiguous. Could be one of: " << std::endl;
-                for (Component result : component_search_results) {
-                    std::cout << "    " << result.name() << std::endl;
-                }
-                std::cout << "Please specify one of these." << std::endl;
+            if (format == "json") {
+                batch_format = BATCH_JSON;
+            } else if (format == "csv") {
+                batch_format = BATCH_CSV;
+            } else {
+                std::cout << "[Error] Unknown batch format '" << format << "', expected json or csv." << std::endl;
                 exit(2);
             }
-
-            excluded_components.push_back(component_search_results[0]);
         }
 
         arg_idx++;
     }
 
+    if (!batch_path.empty()) {
+        // Every query is on its own line, so the only options which apply are those shared by the whole batch.
+        if (!sweep_levels.empty() || stream) {
+            std::cout << "[Error] Level sweeps and streaming search cannot be used in a batch." << std::endl;
+            exit(2);
+        }
+        std::unique_ptr<ResultCache> cache;
+        if (!cache_directory.empty()) {
+            cache = std::make_unique<ResultCache>(cache_directory, data_hash());
+        }
+        std::unique_ptr<GizmoIndex> index;
+        if (!index_path.empty()) {
+            index = GizmoIndex::open(index_path);
+            if (!index) {
+                std::cerr << "[Warning] Could not use gizmo index " << index_path << ", searching instead."
+                          << std::endl;
+            }
+        }
+        exit(run_batch(batch_path, batch_format, thread_count, cache.get(), index.get(), data_hash()));
+    }
+
+    std::string error;
+    if (!valid_query(options, error)) {
+        std::cout << "[Error] " << error << std::endl;
+        exit(2);
+    }
+    if (stream && !sweep_levels.empty()) {
+        std::cout << "[Error] Streaming search cannot be combined with an invention level sweep." << std::endl;
+        exit(2);
+    }
+
+    EquipmentType equipment_type = options.equipment_type;
+    GizmoType gizmo_type = options.gizmo_type;
+    level_t invention_level = options.invention_level;
+    size_t max_results = options.max_results;
+    SearchObjective objective = options.objective;
+    const std::vector<Component> &excluded_components = options.excluded_components;
+
     // Build target gizmo result.
-    GizmoResult target({target_1, target_1_rank}, {target_2, target_2_rank});
+    GizmoResult target = options.target();
 
     // Options set up.
     // Echo the options.
     std::cout << std::endl << "Search configuration:" << std::endl;
     std::cout << std::setw(18) << "Gizmo Type: " << gizmo_type << std::endl;
     std::cout << std::setw(18) << "Equipment Type: " << equipment_type << std::endl;
-    std::cout << std::setw(18) << "Invention Level: " << unsigned(invention_level) << std::endl;
+    if (sweep_levels.empty()) {
+        std::cout << std::setw(18) << "Invention Level: " << unsigned(invention_level) << std::endl;
+    } else {
+        std::cout << std::setw(18) << "Invention Levels: " << format_levels(sweep_levels) << " ("
+                  << sweep_levels.size() << " levels)" << std::endl;
+    }
     std::cout << std::setw(18) << "Target Perks: " << target << std::endl;
+    std::cout << std::setw(18) << "Optimising: " << objective << std::endl;
     if (excluded_components.size() > 0) {
         std::cout << std::setw(18) << "Excluded: " << excluded_components[0] << std::endl;
         std::for_each(excluded_components.begin() + 1,
@@ -268,24 +798,180 @@ int main(int argc, char **argv) {
     std::cout << std::endl;
 
     // Begin the search.
-    OptimalGizmoSearch search(equipment_type, gizmo_type, target);
+    OptimalGizmoSearch search(equipment_type, gizmo_type, target, objective);
+
+    std::vector<GizmoTargetProbability> results;
+    std::vector<LevelSweepResults> sweep_results;
+    size_t num_candidates;
+    std::chrono::milliseconds duration;
+
+    // Reuse any cached results, only searching the levels which are missing.
+    std::vector<level_t> search_levels = sweep_levels.empty() ? std::vector<level_t>{invention_level} : sweep_levels;
+    std::unique_ptr<ResultCache> cache;
+    std::map<level_t, std::vector<CachedResult>> cached_results;
+    auto cacheQuery = [&](level_t level) {
+        return ResultCacheQuery{equipment_type, gizmo_type, level, target, excluded_components, objective,
+                                max_results};
+    };
+    if (!cache_directory.empty()) {
+        auto start = std::chrono::high_resolution_clock::now();
+        cache = std::make_unique<ResultCache>(cache_directory, data_hash());
+        std::vector<level_t> missing_levels;
+        for (level_t level : search_levels) {
+            std::vector<CachedResult> level_results;
+            if (cache->load(cacheQuery(level), level_results)) {
+                cached_results.emplace(level, std::move(level_results));
+            } else {
+                missing_levels.push_back(level);
+            }
+        }
+        search_levels = missing_levels;
+        auto end = std::chrono::high_resolution_clock::now();
+        if (search_levels.empty()) {
+            std::cout << "Results loaded from cache in "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us."
+                      << std::endl;
+        }
+    }
 
-    std::cout << "Status: Generating candidate gizmos..." << std::flush;
-    size_t num_candidates = search.build_candidate_list(excluded_components);
-    std::cout << "\33[2K\rStatus: Searching " << num_candidates << " candidate gizmos..." << std::flush;
-    std::thread progressThread(printProgress, &search);
+    // Look single level queries up in the index instead, if it was built for them.
+    std::deque<Gizmo> index_gizmos;
+    if (!index_path.empty() && !search_levels.empty()) {
+        auto start = std::chrono::high_resolution_clock::now();
+        std::unique_ptr<GizmoIndex> index = GizmoIndex::open(index_path);
+        if (!index) {
+            std::cout << "[Warning] Could not use gizmo index " << index_path << ", searching instead." << std::endl;
+        } else if (!sweep_levels.empty() || !index_answers(*index, cacheQuery(invention_level), data_hash())) {
+            std::cout << "[Warning] Gizmo index " << index_path << " does not cover this query, searching instead."
+                      << std::endl;
+        } else {
+            results = index_results(*index, cacheQuery(invention_level), index_gizmos);
+            search_levels.clear();
+            auto end = std::chrono::high_resolution_clock::now();
+            std::cout << "Results looked up in gizmo index in "
+                      << std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() << "us."
+                      << std::endl;
+        }
+    }
 
-    auto start = std::chrono::high_resolution_clock::now();
-    auto results = search.results(invention_level, thread_count);
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-
-    progressThread.join();
-    double gizmo_per_second = static_cast<double>(num_candidates) / duration.count();
-    std::cout.imbue(std::locale());
-    std::cout << "\33[2K\rSearch completed in "
-              << duration.count()
-              << "ms! (~" << unsigned(gizmo_per_second * 1000) << " gizmos/s)" << std::endl;
+    if (!search_levels.empty()) {
+        if (!sweep_levels.empty()) {
+            std::cout << "Status: Generating candidate gizmos..." << std::flush;
+            num_candidates = search.build_candidate_list(excluded_components, thread_count, search_levels.back());
+            std::cout << "\33[2K\rStatus: Searching " << num_candidates << " candidate gizmos at "
+                      << search_levels.size() << " levels..." << std::flush;
+            std::thread progressThread(printProgress, &search);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            sweep_results = search.levelSweepResults(search_levels, thread_count, grain_size, max_results);
+            auto end = std::chrono::high_resolution_clock::now();
+            duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+            progressThread.join();
+        } else if (stream) {
+            std::thread progressThread(printStreamProgress, &search);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            results = search.streamResults(excluded_components, invention_level, thread_count, batch_size,
+                                           max_results);
+            auto end = std::chrono::high_resolution_clock::now();
+            duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+            num_candidates = search.total_candidates;
+
+            progressThread.join();
+        } else {
+            std::cout << "Status: Generating candidate gizmos..." << std::flush;
+            num_candidates = search.build_candidate_list(excluded_components, thread_count, invention_level);
+            std::cout << "\33[2K\rStatus: Searching " << num_candidates << " candidate gizmos..." << std::flush;
+            std::thread progressThread(printProgress, &search);
+
+            auto start = std::chrono::high_resolution_clock::now();
+            results = search.results(invention_level, thread_count, grain_size, max_results);
+            auto end = std::chrono::high_resolution_clock::now();
+            duration = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+            progressThread.join();
+        }
+        double gizmo_per_second = static_cast<double>(num_candidates) / duration.count();
+        std::cout.imbue(std::locale());
+        std::cout << "\33[2K\rSearch completed in "
+                  << duration.count()
+                  << "ms! (~" << unsigned(gizmo_per_second * 1000) << " gizmos/s)" << std::endl;
+
+        if (thread_count > 1) {
+            std::cout << "Thread busy time:" << std::endl;
+            const std::vector<SubsearchProgress> &thread_progress = search.threadProgress();
+            for (size_t i = 0; i < thread_progress.size(); ++i) {
+                std::cout << std::setw(10) << i << ": " << thread_progress[i].busy_nanoseconds / 1000000 << "ms ("
+                          << thread_progress[i].results_searched << " gizmos in "
+                          << thread_progress[i].chunks_claimed << " chunks, "
+                          << thread_progress[i].candidates_pruned << " pruned)" << std::endl;
+            }
+        }
+
+        if (heap_allocations_counted) {
+            int64_t heap_allocations = 0;
+            for (const SubsearchProgress &thread_progress : search.threadProgress()) {
+                heap_allocations += thread_progress.heap_allocations;
+            }
+            std::cout << "Heap allocations while evaluating: " << heap_allocations << std::endl;
+        }
+
+        if (cache) {
+            for (const LevelSweepResults &level_results : sweep_results) {
+                cache->store(cacheQuery(level_results.invention_level), level_results.results);
+            }
+            if (sweep_levels.empty()) {
+                cache->store(cacheQuery(invention_level), results);
+            }
+        }
+    }
+
+    // Fill in the cached results.
+    for (const auto &[level, level_cached] : cached_results) {
+        std::vector<GizmoTargetProbability> level_results;
+        for (const CachedResult &cached : level_cached) {
+            level_results.emplace_back(&cached.gizmo, cached.target_probability);
+        }
+        if (sweep_levels.empty()) {
+            results = std::move(level_results);
+        } else {
+            sweep_results.push_back({level, std::move(level_results)});
+        }
+    }
+    std::sort(sweep_results.begin(), sweep_results.end(), [](const LevelSweepResults &a, const LevelSweepResults &b) {
+        return a.invention_level < b.invention_level;
+    });
+
+    if (!sweep_levels.empty()) {
+        // One row per result, best first within each level.
+        std::cout << std::endl << "Results:" << std::endl;
+        std::cout << std::setw(6) << "Level" << std::setw(14) << "Probability" << std::setw(15) << "Expected Cost"
+                  << "  Components" << std::endl;
+        for (const LevelSweepResults &level_results : sweep_results) {
+            if (level_results.results.empty()) {
+                std::cout << std::setw(6) << unsigned(level_results.invention_level) << std::setw(14) << "-"
+                          << std::setw(15) << "-" << "  No possible gizmos" << std::endl;
+                continue;
+            }
+
+            for (const GizmoTargetProbability &result : level_results.results) {
+                std::stringstream probability;
+                probability << std::defaultfloat << std::setprecision(6) << 100 * result.target_probability << "%";
+                std::stringstream components;
+                size_t slots = slotsForType(result.gizmo->type());
+                for (size_t i = 0; i < slots; ++i) {
+                    components << (i > 0 ? ", " : "") << result.gizmo->components()[i];
+                }
+                std::cout << std::setw(6) << unsigned(level_results.invention_level)
+                          << std::setw(14) << probability.str()
+                          << std::setw(15)
+                          << static_cast<size_t>(static_cast<float>(result.cost) / result.target_probability)
+                          << "  " << components.str() << std::endl;
+            }
+        }
+        exit(0);
+    }
 
     if (results.empty()) {
         std::cout << std::endl << "No possible gizmos were found." << std::endl;
@@ -0,0 +1,50 @@
+#include "AllocationCounter.h"
+
+#ifdef RSPERKS_COUNT_ALLOCATIONS
+
+#include <cstdlib>
+#include <new>
+
+namespace {
+    thread_local size_t heap_allocations = 0;
+}
+
+void *operator new(size_t size) {
+    heap_allocations++;
+    if (void *ptr = std::malloc(size > 0 ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+size_t threadHeapAllocations() {
+    return heap_allocations;
+}
+
+#else
+
+size_t threadHeapAllocations() {
+    return 0;
+}
+
+#endif
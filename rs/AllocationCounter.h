@@ -0,0 +1,19 @@
+#ifndef RSPERKS_ALLOCATIONCOUNTER_H
+#define RSPERKS_ALLOCATIONCOUNTER_H
+
+
+#include <cstddef>
+
+
+// Heap allocations are only counted when built with RSPERKS_COUNT_ALLOCATIONS, which replaces the global operator new.
+#ifdef RSPERKS_COUNT_ALLOCATIONS
+constexpr bool heap_allocations_counted = true;
+#else
+constexpr bool heap_allocations_counted = false;
+#endif
+
+// Number of heap allocations made by the calling thread so far. Always zero when allocations are not counted.
+size_t threadHeapAllocations();
+
+
+#endif //RSPERKS_ALLOCATIONCOUNTER_H
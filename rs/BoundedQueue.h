@@ -0,0 +1,61 @@
+#ifndef RSPERKS_BOUNDEDQUEUE_H
+#define RSPERKS_BOUNDEDQUEUE_H
+
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+
+/**
+ * A blocking multi-producer/multi-consumer queue holding at most a fixed number of items.
+ *
+ * Producers block in push() while the queue is full, consumers block in pop() while it is empty. Once close() has
+ * been called, pop() drains any remaining items and then returns false.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity > 0 ? capacity : 1), closed_(false) {}
+
+    void push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_ || closed_; });
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty()) {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+};
+
+
+#endif //RSPERKS_BOUNDEDQUEUE_H
@@ -3,6 +3,11 @@
 //
 
 #include "Component.h"
+#include "DataImage.h"
+#include "Gizmo.h"
+#ifdef RSPERKS_EMBED_DATA
+#include "EmbeddedData.h"
+#endif
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -14,29 +19,39 @@ std::string Component::name() const {
 }
 
 std::vector<PerkContribution> &Component::perkContributions(EquipmentType type) const {
-    return Component::component_perk_contributions_.at(type).at(this->id);
+    return Component::component_perk_contributions_.at(type)[this->id];
 }
 
 bool Component::ancient() const {
-    return Component::component_ancient_status_[this->id];
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::component_ancient[this->id];
+#else
+    return Component::component_tables_->ancient[this->id];
+#endif
+}
+
+level_t Component::requiredLevel() const {
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::component_required_levels[this->id];
+#else
+    return Component::component_tables_->required_levels[this->id];
+#endif
 }
 
 int Component::totalPotentialContribution(EquipmentType equipment, perk_id_t perk) const {
-    std::vector<PerkContribution> component_contribution = this->perkContributions(equipment);
-    auto found_contrib = std::find_if(component_contribution.begin(),
-                                      component_contribution.end(),
-                                      [&perk](const PerkContribution &contrib) {
-                                          return contrib.perk.id == perk;
-                                      });
-    return found_contrib != component_contribution.end() ? found_contrib->totalPotentialContribution() : 0;
+    return contribution_tables_.totals[equipment][this->id][perk];
 }
 
 size_t Component::cost() const {
-    return component_costs_[this->id];
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::component_costs[this->id];
+#else
+    return component_tables_->costs[this->id];
+#endif
 }
 
 const std::bitset<std::numeric_limits<perk_id_t>::max()> &Component::possiblePerkBitset(EquipmentType equipment) const {
-    return possible_perk_bitsets_[equipment].at(this->id);
+    return component_tables_->possible_perk_bitsets[equipment][this->id];
 }
 
 bool Component::operator==(const Component &other) const {
@@ -61,15 +76,10 @@ size_t Component::registerComponents(std::string filename) {
         all_.push_back(Component::empty);
         components_by_id_[empty_component_id] = Component::empty;
         components_by_name_.insert({"Empty", Component::empty});
-        component_ancient_status_[empty_component_id] = false;
+        component_table_storage_.ancient[empty_component_id] = false;
+        component_table_storage_.required_levels[empty_component_id] = 0;
         component_names_.insert({empty_component_id, "Empty"});
-        component_perk_contributions_[WEAPON].insert({empty_component_id, {}});
-        component_perk_contributions_[TOOL].insert({empty_component_id, {}});
-        component_perk_contributions_[ARMOUR].insert({empty_component_id, {}});
-        possible_perk_bitsets_[WEAPON].insert({empty_component_id, {}});
-        possible_perk_bitsets_[TOOL].insert({empty_component_id, {}});
-        possible_perk_bitsets_[ARMOUR].insert({empty_component_id, {}});
-        component_costs_[empty_component_id] = 0;
+        component_table_storage_.costs[empty_component_id] = 0;
     }
 
     std::ifstream comp_data_file;
@@ -80,7 +90,7 @@ size_t Component::registerComponents(std::string filename) {
     }
 
     std::string line;
-    // File format is ID,Name,EquipmentType,PerkName,Base,Roll,Ancient
+    // File format is ID,Name,EquipmentType,PerkName,Base,Roll,Ancient,RequiredLevel
     while (std::getline(comp_data_file, line)) {
         std::stringstream ls(line);
         std::string token;
@@ -113,6 +123,12 @@ size_t Component::registerComponents(std::string filename) {
         std::getline(ls, token, ',');
         bool ancient = std::stoi(token) != 0;
 
+        // Get Required Level, if given
+        level_t required_level = 1;
+        if (std::getline(ls, token, ',') && !token.empty()) {
+            required_level = std::stoi(token);
+        }
+
         // Create objects and add to relevant stores.
         if (!components_by_id_[component_id].id) {
             // Not encountered this component before.
@@ -120,27 +136,18 @@ size_t Component::registerComponents(std::string filename) {
             all_.push_back(new_comp);
             components_by_id_[component_id] = new_comp;
             components_by_name_.insert({component_name, new_comp});
-            component_ancient_status_[component_id] = ancient;
+            component_table_storage_.ancient[component_id] = ancient;
+            component_table_storage_.required_levels[component_id] = required_level;
             component_names_.insert({component_id, component_name});
 
-            component_perk_contributions_[WEAPON].insert({component_id, {}});
-            component_perk_contributions_[TOOL].insert({component_id, {}});
-            component_perk_contributions_[ARMOUR].insert({component_id, {}});
-
-            possible_perk_bitsets_[WEAPON].insert({component_id, {}});
-            possible_perk_bitsets_[TOOL].insert({component_id, {}});
-            possible_perk_bitsets_[ARMOUR].insert({component_id, {}});
-
             // Note: Cost can be overridden later.
-            component_costs_[component_id] = 0;
+            component_table_storage_.costs[component_id] = 0;
         }
 
         // Add perk contribution.
-        component_perk_contributions_[perk_equip_type].at(component_id).push_back({possible_perk,
-                                                                                   perk_base,
-                                                                                   perk_roll});
+        addPerkContribution(perk_equip_type, component_id, {possible_perk, perk_base, perk_roll});
         // Set bit in possible perk bitsets.
-        possible_perk_bitsets_[perk_equip_type].at(component_id).set(possible_perk.id);
+        component_table_storage_.possible_perk_bitsets[perk_equip_type][component_id].set(possible_perk.id);
     }
 
     return 0;
@@ -175,25 +182,111 @@ size_t Component::registerCosts(std::string filename) {
         size_t component_cost = std::stoi(token);
 
         // Insert component cost mapping.
-        component_costs_[component_id] = component_cost;
+        component_table_storage_.costs[component_id] = component_cost;
     }
 
     return 0;
 }
 
+size_t Component::registerComponents(const DataImage &image) {
+    // The image lists every component, the empty one included, in the order they were registered when it was built.
+    component_tables_ = &image.componentTables();
+    all_.reserve(image.components().size());
+    component_names_.reserve(image.components().size());
+    components_by_name_.reserve(image.components().size());
+    for (const DataImage::ComponentRecord &record : image.components()) {
+        Component component = {record.id};
+        std::string component_name = image.string(record.name);
+        all_.push_back(component);
+        components_by_id_[record.id] = component;
+        components_by_name_.insert({component_name, component});
+        component_names_.insert({record.id, std::move(component_name)});
+
+        for (size_t equipment = 0; equipment < EquipmentType::SIZE; ++equipment) {
+            component_perk_contributions_[equipment][record.id].reserve(record.contributions[equipment].count);
+            for (const DataImage::ContributionRecord &contribution : image.contributions(record, equipment)) {
+                addPerkContribution(static_cast<EquipmentType>(equipment), record.id,
+                                    {Perk::get(contribution.perk), contribution.base, contribution.roll});
+            }
+        }
+    }
+
+    return 0;
+}
+
+const ComponentTables &Component::tables() {
+    return *component_tables_;
+}
+
+const ContributionTables &Component::contributionTables() {
+    return contribution_tables_;
+}
+
+void Component::addPerkContribution(EquipmentType equipment, component_id_t id, const PerkContribution &contribution) {
+    component_perk_contributions_[equipment][id].push_back(contribution);
+    // Gizmos work out their perks in fixed size tables, which only have room for every slot to give this many.
+    if (component_perk_contributions_[equipment][id].size() * slotsForType(ANCIENT) > PerkRankTable::max_perks) {
+        std::cerr << "[Error] Component " << Component{id}.name() << " gives too many perks on " << equipment
+                  << " equipment: at most " << PerkRankTable::max_perks / slotsForType(ANCIENT)
+                  << " are supported per component." << std::endl;
+        exit(1);
+    }
+    contribution_tables_.bases[equipment][id][contribution.perk.id] = contribution.base;
+    contribution_tables_.rolls[equipment][id][contribution.perk.id] = contribution.roll;
+    contribution_tables_.totals[equipment][id][contribution.perk.id] = contribution.totalPotentialContribution();
+}
+
+#ifdef RSPERKS_EMBED_DATA
+size_t Component::registerEmbedded() {
+    // Lookups by ID use the constant tables, but the bitsets cannot be built as constants, and the lists and name
+    // lookups are not constants either.
+    all_.reserve(rs::embedded::components.size());
+    for (const rs::embedded::EmbeddedComponent &embedded : rs::embedded::components) {
+        Component component = {embedded.id};
+        all_.push_back(component);
+        components_by_id_[embedded.id] = component;
+        components_by_name_.insert({std::string(embedded.name), component});
+        component_names_.insert({embedded.id, std::string(embedded.name)});
+        component_table_storage_.costs[embedded.id] = embedded.cost;
+        component_table_storage_.ancient[embedded.id] = embedded.ancient;
+        component_table_storage_.required_levels[embedded.id] = embedded.required_level;
+
+        for (size_t equipment = 0; equipment < EquipmentType::SIZE; ++equipment) {
+            const rs::embedded::ContributionRange &range = embedded.contributions[equipment];
+            component_perk_contributions_[equipment][embedded.id].reserve(range.count);
+            for (size_t i = range.offset; i < range.offset + range.count; ++i) {
+                const rs::embedded::EmbeddedContribution &contribution = rs::embedded::contributions[i];
+                addPerkContribution(static_cast<EquipmentType>(equipment), embedded.id,
+                                    {rs::embedded::perks_by_id[contribution.perk], contribution.base,
+                                     contribution.roll});
+                component_table_storage_.possible_perk_bitsets[equipment][embedded.id].set(contribution.perk);
+            }
+        }
+    }
+
+    return 0;
+}
+#endif
+
 std::vector<Component> Component::all_;
 
 std::unordered_map<component_id_t, std::string> Component::component_names_;
-std::array<std::unordered_map<component_id_t, std::vector<PerkContribution>>, EquipmentType::SIZE>
-        Component::component_perk_contributions_;
-std::array<size_t, std::numeric_limits<component_id_t>::max()> Component::component_costs_;
-std::array<bool, std::numeric_limits<component_id_t>::max()> Component::component_ancient_status_;
-std::array<std::unordered_map<component_id_t, std::bitset<std::numeric_limits<perk_id_t>::max()>>, EquipmentType::SIZE>
-        Component::possible_perk_bitsets_;
-
-std::array<Component, std::numeric_limits<component_id_t>::max()> Component::components_by_id_;
+std::array<std::array<std::vector<PerkContribution>, std::numeric_limits<component_id_t>::max() + 1>,
+        EquipmentType::SIZE> Component::component_perk_contributions_;
+ContributionTables Component::contribution_tables_;
+ComponentTables Component::component_table_storage_;
+const ComponentTables *Component::component_tables_ = &Component::component_table_storage_;
+
+std::array<Component, std::numeric_limits<component_id_t>::max() + 1> Component::components_by_id_;
 std::unordered_map<std::string, Component> Component::components_by_name_;
 
+#ifdef RSPERKS_EMBED_DATA
+namespace {
+    // Must come after the definitions above, which are initialised in order.
+    const size_t embedded_components_registered = Component::registerEmbedded();
+}
+#endif
+
 std::ostream &operator<<(std::ostream &strm, const Component &component) {
     return strm << component.name();
 }
@@ -26,6 +26,28 @@ struct PerkContribution {
     }
 };
 
+// Per component data, indexed by component ID. Flat and trivially copyable, so it can be used directly from a data
+// image.
+struct ComponentTables {
+    std::array<size_t, std::numeric_limits<component_id_t>::max() + 1> costs;
+    std::array<std::array<std::bitset<std::numeric_limits<perk_id_t>::max()>,
+            std::numeric_limits<component_id_t>::max() + 1>, EquipmentType::SIZE> possible_perk_bitsets;
+    std::array<bool, std::numeric_limits<component_id_t>::max() + 1> ancient;
+    std::array<level_t, std::numeric_limits<component_id_t>::max() + 1> required_levels;
+};
+
+// Perk contributions of every component, indexed by equipment type, component ID and perk ID. Zero wherever a component
+// cannot give a perk, so lookups need no search.
+struct ContributionTables {
+    template<typename T>
+    using table_t = std::array<std::array<std::array<T, std::numeric_limits<perk_id_t>::max()>,
+            std::numeric_limits<component_id_t>::max() + 1>, EquipmentType::SIZE>;
+
+    table_t<contribution_base_t> bases;
+    table_t<contribution_roll_t> rolls;
+    table_t<uint16_t> totals;
+};
+
 struct Component {
     component_id_t id;
 
@@ -35,6 +57,9 @@ struct Component {
 
     [[nodiscard]] bool ancient() const;
 
+    // Invention level needed to use this component in a gizmo.
+    [[nodiscard]] level_t requiredLevel() const;
+
     [[nodiscard]] size_t cost() const;
 
     [[nodiscard]] int totalPotentialContribution(EquipmentType equipment, perk_id_t perk) const;
@@ -56,20 +81,36 @@ struct Component {
 
     static size_t registerCosts(std::string filename);
 
+    // Registers the components and their costs from a data image, using its tables in place. Must be called after
+    // Perk::registerPerks with the same image, and instead of the data files, not as well.
+    static size_t registerComponents(const DataImage &image);
+
+    [[nodiscard]] static const ComponentTables &tables();
+
+    [[nodiscard]] static const ContributionTables &contributionTables();
+
+#ifdef RSPERKS_EMBED_DATA
+    // Registers the data compiled into the tool. This runs before main, so the tools do not need to call it.
+    static size_t registerEmbedded();
+#endif
+
 private:
     static std::vector<Component> all_;
 
     static std::unordered_map<component_id_t, std::string> component_names_;
-    static std::array<std::unordered_map<component_id_t, std::vector<PerkContribution>>, EquipmentType::SIZE>
-            component_perk_contributions_;
-    static std::array<size_t, std::numeric_limits<component_id_t>::max()> component_costs_;
-    static std::array<bool, std::numeric_limits<component_id_t>::max()> component_ancient_status_;
-    static std::array<std::unordered_map<component_id_t, std::bitset<std::numeric_limits<perk_id_t>::max()>>,
-            EquipmentType::SIZE>
-            possible_perk_bitsets_;
-
-    static std::array<Component, std::numeric_limits<component_id_t>::max()> components_by_id_;
+    // Each component's contributions in data file order, indexed by equipment type and component ID.
+    static std::array<std::array<std::vector<PerkContribution>, std::numeric_limits<component_id_t>::max() + 1>,
+            EquipmentType::SIZE> component_perk_contributions_;
+    static ContributionTables contribution_tables_;
+    // Points at component_table_storage_, unless the components came from a data image.
+    static ComponentTables component_table_storage_;
+    static const ComponentTables *component_tables_;
+
+    static std::array<Component, std::numeric_limits<component_id_t>::max() + 1> components_by_id_;
     static std::unordered_map<std::string, Component> components_by_name_;
+
+    // Adds to both the contribution list and the contribution tables.
+    static void addPerkContribution(EquipmentType equipment, component_id_t id, const PerkContribution &contribution);
 };
 
 std::ostream &operator<<(std::ostream &strm, const Component &component);
@@ -0,0 +1,217 @@
+#include "DataImage.h"
+#include <bitset>
+#include <type_traits>
+#include <vector>
+
+
+static_assert(std::is_trivially_copyable_v<PerkTables> && std::is_trivially_copyable_v<ComponentTables>,
+              "Data image tables are used in place, so must be trivially copyable");
+
+struct DataImage::Header {
+    MappedFormat<5> format;
+    uint64_t size;
+    uint64_t data_hash;
+    Section perk_tables;
+    Section component_tables;
+    Section perks;
+    Section components;
+    Section contributions;
+    Section strings;
+};
+
+namespace {
+    constexpr MappedFormat<5> image_format = {
+            {'R', 'S', 'G', 'D'}, 1, MappedFormat<5>::byte_order_mark,
+            {sizeof(PerkTables), sizeof(ComponentTables), sizeof(DataImage::PerkRecord),
+             sizeof(DataImage::ComponentRecord), sizeof(DataImage::ContributionRecord)}};
+
+    template<size_t N>
+    bool validFlags(const std::array<bool, N> &flags) {
+        // Check the bytes themselves, as reading a bool that is neither 0 nor 1 is undefined.
+        const auto *bytes = reinterpret_cast<const uint8_t *>(flags.data());
+        for (size_t i = 0; i < N; ++i) {
+            if (bytes[i] > 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+std::unique_ptr<DataImage> DataImage::registered_;
+
+DataImage::DataImage(std::unique_ptr<MappedFile> file) :
+        file_(std::move(file)),
+        data_(file_->data()),
+        size_(file_->size()) {
+
+}
+
+uint64_t DataImage::dataHash() const {
+    return header().data_hash;
+}
+
+const PerkTables &DataImage::perkTables() const {
+    return *section<PerkTables>(header().perk_tables);
+}
+
+const ComponentTables &DataImage::componentTables() const {
+    return *section<ComponentTables>(header().component_tables);
+}
+
+DataImage::Records<DataImage::PerkRecord> DataImage::perks() const {
+    return {section<PerkRecord>(header().perks), header().perks.count};
+}
+
+DataImage::Records<DataImage::ComponentRecord> DataImage::components() const {
+    return {section<ComponentRecord>(header().components), header().components.count};
+}
+
+DataImage::Records<DataImage::ContributionRecord>
+DataImage::contributions(const ComponentRecord &component, size_t equipment) const {
+    const ContributionRange &range = component.contributions[equipment];
+    return {section<ContributionRecord>(header().contributions) + range.offset, range.count};
+}
+
+std::string DataImage::string(StringRecord record) const {
+    return std::string(section<char>(header().strings) + record.offset, record.size);
+}
+
+const DataImage::Header &DataImage::header() const {
+    return *reinterpret_cast<const Header *>(data_);
+}
+
+template<typename T>
+const T *DataImage::section(const Section &section) const {
+    return reinterpret_cast<const T *>(data_ + section.offset);
+}
+
+bool DataImage::valid() const {
+    if (size_ < sizeof(Header)) {
+        return false;
+    }
+    const Header &image_header = header();
+    if (!(image_header.format == image_format) || image_header.size != size_) {
+        return false;
+    }
+
+    if (!image_header.perk_tables.fits(size_, sizeof(PerkTables)) || image_header.perk_tables.count != 1 ||
+        !image_header.component_tables.fits(size_, sizeof(ComponentTables)) ||
+        image_header.component_tables.count != 1 ||
+        !image_header.perks.fits(size_, sizeof(PerkRecord)) ||
+        !image_header.components.fits(size_, sizeof(ComponentRecord)) ||
+        !image_header.contributions.fits(size_, sizeof(ContributionRecord)) ||
+        !image_header.strings.fits(size_, 1)) {
+        return false;
+    }
+    if (!validFlags(perkTables().two_slot) || !validFlags(componentTables().ancient)) {
+        return false;
+    }
+
+    // Every record has to refer to something within the image, as they are used without further checks.
+    auto valid_string = [&image_header](StringRecord record) {
+        return record.offset <= image_header.strings.count && record.size <= image_header.strings.count - record.offset;
+    };
+    std::bitset<std::numeric_limits<perk_id_t>::max()> perk_ids;
+    for (const PerkRecord &perk : perks()) {
+        if (perk.id >= perk_ids.size() || !valid_string(perk.name)) {
+            return false;
+        }
+        perk_ids.set(perk.id);
+    }
+    for (const ComponentRecord &component : components()) {
+        if (!valid_string(component.name)) {
+            return false;
+        }
+        for (const ContributionRange &range : component.contributions) {
+            if (range.offset > image_header.contributions.count ||
+                range.count > image_header.contributions.count - range.offset) {
+                return false;
+            }
+        }
+    }
+    const auto *contribution_records = section<ContributionRecord>(image_header.contributions);
+    for (size_t i = 0; i < image_header.contributions.count; ++i) {
+        if (contribution_records[i].perk >= perk_ids.size() || !perk_ids.test(contribution_records[i].perk)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::unique_ptr<DataImage> DataImage::open(const std::string &filename) {
+    std::unique_ptr<MappedFile> file = MappedFile::open(filename);
+    if (!file) {
+        return nullptr;
+    }
+    std::unique_ptr<DataImage> image(new DataImage(std::move(file)));
+    if (!image->valid()) {
+        return nullptr;
+    }
+    return image;
+}
+
+const DataImage *DataImage::registerImage(const std::string &filename) {
+    std::unique_ptr<DataImage> image = open(filename);
+    if (!image) {
+        return nullptr;
+    }
+    Perk::registerPerks(*image);
+    Component::registerComponents(*image);
+    registered_ = std::move(image);
+    return registered_.get();
+}
+
+bool DataImage::write(const std::string &filename, uint64_t data_hash) {
+    // Records are listed in registration order, so registering from the image gives the same order as the data files.
+    std::string strings;
+    auto add_string = [&strings](const std::string &value) {
+        StringRecord record = {static_cast<uint32_t>(strings.size()), static_cast<uint32_t>(value.size())};
+        strings += value;
+        return record;
+    };
+
+    std::vector<PerkRecord> perk_records;
+    for (const Perk &perk : Perk::all()) {
+        PerkRecord record{};
+        record.name = add_string(perk.name());
+        record.id = perk.id;
+        record.max_rank = perk.max_rank;
+        perk_records.push_back(record);
+    }
+
+    std::vector<ComponentRecord> component_records;
+    std::vector<ContributionRecord> contribution_records;
+    for (const Component &component : Component::all()) {
+        ComponentRecord record{};
+        record.name = add_string(component.name());
+        record.id = component.id;
+        for (size_t equipment = 0; equipment < EquipmentType::SIZE; ++equipment) {
+            const std::vector<PerkContribution> &contributions =
+                    component.perkContributions(static_cast<EquipmentType>(equipment));
+            record.contributions[equipment] = {static_cast<uint32_t>(contribution_records.size()),
+                                               static_cast<uint32_t>(contributions.size())};
+            for (const PerkContribution &contribution : contributions) {
+                contribution_records.push_back({contribution.perk.id, contribution.base, contribution.roll});
+            }
+        }
+        component_records.push_back(record);
+    }
+
+    MappedFileBuilder builder(sizeof(Header));
+    Header image_header{};
+    image_header.format = image_format;
+    image_header.data_hash = data_hash;
+    image_header.perk_tables = builder.add(&Perk::tables(), sizeof(PerkTables), 1);
+    image_header.component_tables = builder.add(&Component::tables(), sizeof(ComponentTables), 1);
+    image_header.perks = builder.add(perk_records.data(), sizeof(PerkRecord), perk_records.size());
+    image_header.components = builder.add(component_records.data(), sizeof(ComponentRecord),
+                                          component_records.size());
+    image_header.contributions = builder.add(contribution_records.data(), sizeof(ContributionRecord),
+                                             contribution_records.size());
+    image_header.strings = builder.add(strings.data(), 1, strings.size());
+    image_header.size = builder.size();
+
+    return MappedFile::replace(filename, builder.contents(&image_header));
+}
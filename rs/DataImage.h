@@ -0,0 +1,109 @@
+#ifndef RSPERKS_DATAIMAGE_H
+#define RSPERKS_DATAIMAGE_H
+
+
+#include "InventionTypes.h"
+#include "Perk.h"
+#include "Component.h"
+#include "MappedFile.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+/**
+ * Perk and component data compiled into one flat binary file, which is memory mapped at startup instead of parsing the
+ * data files.
+ *
+ * The per ID tables are stored exactly as PerkTables and ComponentTables lay them out, and the registries use them in
+ * place. Everything else is a short list of fixed size records, with names in a shared string section. The image is a
+ * build artefact rather than an interchange format: it is only valid for builds with the same record layouts and byte
+ * order, which the header records, and anything that does not match is rejected so the data files can be used instead.
+ */
+class DataImage {
+public:
+    struct StringRecord {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    struct PerkRecord {
+        StringRecord name;
+        perk_id_t id;
+        rank_t max_rank;
+    };
+
+    struct ContributionRange {
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    struct ComponentRecord {
+        StringRecord name;
+        std::array<ContributionRange, EquipmentType::SIZE> contributions;
+        component_id_t id;
+    };
+
+    struct ContributionRecord {
+        perk_id_t perk;
+        contribution_base_t base;
+        contribution_roll_t roll;
+    };
+
+    template<typename T>
+    using Records = MappedRecords<T>;
+
+    DataImage(const DataImage &) = delete;
+
+    DataImage &operator=(const DataImage &) = delete;
+
+    // Hash of the data files the image was built from, as given to write.
+    [[nodiscard]] uint64_t dataHash() const;
+
+    [[nodiscard]] const PerkTables &perkTables() const;
+
+    [[nodiscard]] const ComponentTables &componentTables() const;
+
+    [[nodiscard]] Records<PerkRecord> perks() const;
+
+    [[nodiscard]] Records<ComponentRecord> components() const;
+
+    [[nodiscard]] Records<ContributionRecord> contributions(const ComponentRecord &component, size_t equipment) const;
+
+    [[nodiscard]] std::string string(StringRecord record) const;
+
+    // Maps and checks an image. Returns nullptr if it is missing, or was built for a different format or layout.
+    [[nodiscard]] static std::unique_ptr<DataImage> open(const std::string &filename);
+
+    // Opens an image and registers its perks and components, in place of the data files. The image is kept for the
+    // rest of the process, as the registries use it in place. Returns nullptr, having registered nothing, if the image
+    // cannot be used. Call at most once, before registering anything else.
+    static const DataImage *registerImage(const std::string &filename);
+
+    // Writes the currently registered perks and components to an image. data_hash identifies the data files.
+    static bool write(const std::string &filename, uint64_t data_hash);
+
+private:
+    typedef MappedSection Section;
+
+    struct Header;
+
+    std::unique_ptr<MappedFile> file_;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+
+    explicit DataImage(std::unique_ptr<MappedFile> file);
+
+    [[nodiscard]] const Header &header() const;
+
+    template<typename T>
+    [[nodiscard]] const T *section(const Section &section) const;
+
+    [[nodiscard]] bool valid() const;
+
+    static std::unique_ptr<DataImage> registered_;
+};
+
+
+#endif //RSPERKS_DATAIMAGE_H
@@ -0,0 +1,100 @@
+#include "DistributionCache.h"
+
+namespace {
+    template<typename T>
+    size_t vectorBytes(const std::vector<T> &values) {
+        return values.capacity() * sizeof(T);
+    }
+}
+
+size_t DistributionCache::entryBytes(const Entry &entry) {
+    return sizeof(Key) + sizeof(Entry) + vectorBytes(entry.perks) + vectorBytes(entry.rank_counts) +
+           vectorBytes(entry.ranks) + vectorBytes(entry.any_pair);
+}
+
+DistributionCache::DistributionCache(size_t max_bytes) : distributions_(max_bytes) {
+
+}
+
+bool DistributionCache::Key::operator==(const Key &other) const {
+    return equipment_type == other.equipment_type && gizmo_type == other.gizmo_type &&
+           components == other.components;
+}
+
+std::size_t DistributionCache::KeyHash::operator()(const Key &key) const {
+    Fnv1aHash hash;
+    hash.add(key.equipment_type);
+    hash.add(key.gizmo_type);
+    for (component_id_t id : key.components) {
+        hash.add(id);
+    }
+    return hash.value();
+}
+
+DistributionCache::Key DistributionCache::key(const Gizmo &gizmo) {
+    Key key = {static_cast<uint8_t>(gizmo.equipmentType()), static_cast<uint8_t>(gizmo.type()), {}};
+    for (size_t i = 0; i < key.components.size(); ++i) {
+        key.components[i] = gizmo.components()[i].id;
+    }
+    return key;
+}
+
+bool DistributionCache::find(const Gizmo &gizmo, GizmoDistribution &distribution) {
+    return distributions_.find(key(gizmo), [&distribution](const Entry &entry) {
+        PerkRankTable &rank_probabilities = distribution.rank_probabilities;
+        rank_probabilities.perk_count = entry.perks.size();
+        auto ranks = entry.ranks.begin();
+        for (size_t i = 0; i < entry.perks.size(); ++i) {
+            rank_probabilities.perks[i] = entry.perks[i];
+            rank_probabilities.rank_counts[i] = entry.rank_counts[i];
+            std::copy(ranks, ranks + entry.rank_counts[i], rank_probabilities.ranks[i].begin());
+            ranks += entry.rank_counts[i];
+        }
+        distribution.any_pair.count = entry.any_pair.size();
+        std::copy(entry.any_pair.begin(), entry.any_pair.end(), distribution.any_pair.terms.begin());
+    });
+}
+
+void DistributionCache::insert(const Gizmo &gizmo, const GizmoDistribution &distribution) {
+    // Pack the entry without holding the lock.
+    const PerkRankTable &rank_probabilities = distribution.rank_probabilities;
+    size_t perk_count = rank_probabilities.perk_count;
+    Entry entry;
+    entry.perks.assign(rank_probabilities.perks.begin(), rank_probabilities.perks.begin() + perk_count);
+    entry.rank_counts.assign(rank_probabilities.rank_counts.begin(),
+                             rank_probabilities.rank_counts.begin() + perk_count);
+    for (size_t i = 0; i < perk_count; ++i) {
+        entry.ranks.insert(entry.ranks.end(), rank_probabilities.ranks[i].begin(),
+                           rank_probabilities.ranks[i].begin() + rank_probabilities.rank_counts[i]);
+    }
+    entry.any_pair.assign(distribution.any_pair.terms.begin(),
+                          distribution.any_pair.terms.begin() + distribution.any_pair.count);
+    size_t entry_bytes = entryBytes(entry);
+    // Another thread may have got there first, with the same distribution.
+    distributions_.insert(key(gizmo), std::move(entry), entry_bytes);
+}
+
+void DistributionCache::clear() {
+    distributions_.clear();
+}
+
+size_t DistributionCache::hits() const {
+    return distributions_.hits();
+}
+
+size_t DistributionCache::misses() const {
+    return distributions_.misses();
+}
+
+size_t DistributionCache::entries() const {
+    return distributions_.entries();
+}
+
+size_t DistributionCache::bytes() const {
+    return distributions_.bytes();
+}
+
+DistributionCache &DistributionCache::shared() {
+    static DistributionCache cache;
+    return cache;
+}
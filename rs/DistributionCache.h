@@ -0,0 +1,71 @@
+#ifndef RSPERKS_DISTRIBUTIONCACHE_H
+#define RSPERKS_DISTRIBUTIONCACHE_H
+
+
+#include "InventionTypes.h"
+#include "Gizmo.h"
+#include "ShardedCache.h"
+#include <array>
+#include <vector>
+
+
+/**
+ * Thread-safe memo of gizmo distributions, keyed by equipment type, gizmo type and components.
+ *
+ * Candidates are in Gizmo Normal Form, in which equal component lists give equal perk distributions, and a
+ * distribution depends on neither the target nor the invention level. So searches for different targets which reach
+ * the same candidates can share one cache and skip straight to evaluating against the budget. Entries are packed down
+ * to the perks and ranks each gizmo actually has, and memory is bounded as described in ShardedCache.
+ */
+class DistributionCache {
+public:
+    explicit DistributionCache(size_t max_bytes = 256 * 1024 * 1024);
+
+    // Copies the cached distribution of a gizmo into distribution. Returns false if there is none.
+    bool find(const Gizmo &gizmo, GizmoDistribution &distribution);
+
+    void insert(const Gizmo &gizmo, const GizmoDistribution &distribution);
+
+    void clear();
+
+    [[nodiscard]] size_t hits() const;
+
+    [[nodiscard]] size_t misses() const;
+
+    [[nodiscard]] size_t entries() const;
+
+    [[nodiscard]] size_t bytes() const;
+
+    // Cache shared by every search in the process.
+    static DistributionCache &shared();
+
+private:
+    struct Key {
+        uint8_t equipment_type;
+        uint8_t gizmo_type;
+        std::array<component_id_t, 9> components;
+
+        bool operator==(const Key &other) const;
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const;
+    };
+
+    // A distribution with its fixed size tables cut down to the entries in use.
+    struct Entry {
+        std::vector<Perk> perks;
+        std::vector<uint8_t> rank_counts;
+        std::vector<std::pair<rank_t, probability_t>> ranks;
+        std::vector<AnyPairTerms::CostTerm> any_pair;
+    };
+
+    ShardedCache<Key, Entry, KeyHash> distributions_;
+
+    static Key key(const Gizmo &gizmo);
+
+    static size_t entryBytes(const Entry &entry);
+};
+
+
+#endif //RSPERKS_DISTRIBUTIONCACHE_H
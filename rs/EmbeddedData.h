@@ -0,0 +1,125 @@
+#ifndef RSPERKS_EMBEDDEDDATA_H
+#define RSPERKS_EMBEDDEDDATA_H
+
+
+#include "InventionTypes.h"
+#include "Perk.h"
+#include "Component.h"
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+
+/**
+ * Perk and component data compiled into the tools, for builds with RSPERKS_EMBED_DATA.
+ *
+ * gizmo-data turns the data files into EmbeddedDataTables.h, which lists the perks, ranks, components and
+ * contributions in the order the data files register them. The per ID perk and component tables are then built from
+ * those lists as constants and used in place, so lookups into them can be folded by the compiler. Contributions are
+ * copied into the dense ContributionTables at registration, before main, like the ones from the data files.
+ */
+namespace rs::embedded {
+    struct EmbeddedPerk {
+        perk_id_t id;
+        rank_t max_rank;
+        bool two_slot;
+        std::string_view name;
+    };
+
+    struct EmbeddedRank {
+        perk_id_t perk;
+        Rank rank;
+    };
+
+    struct ContributionRange {
+        uint16_t offset;
+        uint16_t count;
+    };
+
+    struct EmbeddedComponent {
+        component_id_t id;
+        std::string_view name;
+        size_t cost;
+        bool ancient;
+        level_t required_level;
+        std::array<ContributionRange, EquipmentType::SIZE> contributions;
+    };
+
+    struct EmbeddedContribution {
+        perk_id_t perk;
+        contribution_base_t base;
+        contribution_roll_t roll;
+    };
+}
+
+#include "EmbeddedDataTables.h"
+
+namespace rs::embedded {
+    constexpr PerkTables makePerkTables() {
+        PerkTables tables{};
+        for (const EmbeddedPerk &perk : perks) {
+            tables.two_slot[perk.id] = perk.two_slot;
+        }
+        for (const EmbeddedRank &rank : perk_ranks) {
+            tables.ranks[rank.perk][rank.rank.rank] = rank.rank;
+        }
+        return tables;
+    }
+
+    constexpr PerkTables perk_tables = makePerkTables();
+
+    constexpr std::array<Perk, std::numeric_limits<perk_id_t>::max()> makePerksById() {
+        std::array<Perk, std::numeric_limits<perk_id_t>::max()> by_id{};
+        for (const EmbeddedPerk &perk : perks) {
+            by_id[perk.id] = {perk.id, perk.max_rank};
+        }
+        return by_id;
+    }
+
+    constexpr std::array<Perk, std::numeric_limits<perk_id_t>::max()> perks_by_id = makePerksById();
+
+    // Index into components for each component ID, or -1 for IDs with no component.
+    constexpr std::array<int16_t, std::numeric_limits<component_id_t>::max() + 1> makeComponentIndices() {
+        std::array<int16_t, std::numeric_limits<component_id_t>::max() + 1> indices{};
+        for (int16_t &index : indices) {
+            index = -1;
+        }
+        for (size_t i = 0; i < components.size(); ++i) {
+            indices[components[i].id] = static_cast<int16_t>(i);
+        }
+        return indices;
+    }
+
+    constexpr std::array<int16_t, std::numeric_limits<component_id_t>::max() + 1> component_indices =
+            makeComponentIndices();
+
+    constexpr const EmbeddedComponent *component(component_id_t id) {
+        return component_indices[id] < 0 ? nullptr : &components[component_indices[id]];
+    }
+
+    // A per component ID table of one field, zero for IDs with no component.
+    template<typename T, typename F>
+    constexpr std::array<T, std::numeric_limits<component_id_t>::max() + 1> makeComponentTable(F field) {
+        std::array<T, std::numeric_limits<component_id_t>::max() + 1> table{};
+        for (const EmbeddedComponent &embedded : components) {
+            table[embedded.id] = field(embedded);
+        }
+        return table;
+    }
+
+    constexpr std::array<size_t, std::numeric_limits<component_id_t>::max() + 1> component_costs =
+            makeComponentTable<size_t>([](const EmbeddedComponent &embedded) { return embedded.cost; });
+
+    constexpr std::array<bool, std::numeric_limits<component_id_t>::max() + 1> component_ancient =
+            makeComponentTable<bool>([](const EmbeddedComponent &embedded) { return embedded.ancient; });
+
+    constexpr std::array<level_t, std::numeric_limits<component_id_t>::max() + 1> component_required_levels =
+            makeComponentTable<level_t>([](const EmbeddedComponent &embedded) { return embedded.required_level; });
+
+    static_assert(component_indices[empty_component_id] >= 0 &&
+                  components[component_indices[empty_component_id]].name == "Empty",
+                  "Embedded data must include the empty component");
+}
+
+
+#endif //RSPERKS_EMBEDDEDDATA_H
@@ -3,6 +3,9 @@
 //
 
 #include "Gizmo.h"
+#include "GizmoPrefixState.h"
+#include "RollCdfCache.h"
+#include "SimdKernels.h"
 #include "RSSort.h"
 #include <bitset>
 #include <iomanip>
@@ -31,31 +34,32 @@ bool GizmoResult::operator==(const GizmoResult &other) const {
            this->second.rank == other.second.rank;
 }
 
+uint32_t GizmoResult::key() const {
+    return (static_cast<uint32_t>(first.perk.id) << 24) |
+           (static_cast<uint32_t>(first.rank) << 16) |
+           (static_cast<uint32_t>(second.perk.id) << 8) |
+           static_cast<uint32_t>(second.rank);
+}
+
 std::size_t GizmoResultHash::operator()(const GizmoResult &result) const {
-    return std::hash<int>{}((result.first.perk.id << 24) |
-                            (result.first.rank << 16) |
-                            (result.second.perk.id << 8) |
-                            (result.second.rank));
+    return std::hash<int>{}(static_cast<int>(result.key()));
 }
 
-Gizmo::Gizmo(EquipmentType equipment_type, GizmoType gizmo_type, std::vector<Component> components) {
+Gizmo::Gizmo(EquipmentType equipment_type, GizmoType gizmo_type, const std::vector<Component> &components) {
     this->equipment_type_ = equipment_type;
     this->gizmo_type_ = gizmo_type;
     assert(!(gizmo_type == STANDARD) || (components.size() <= slotsForType(STANDARD)));
     assert(!(gizmo_type == ANCIENT) || (components.size() <= slotsForType(ANCIENT)));
     auto last_specified = std::copy(components.begin(), components.end(), components_.begin());
     std::fill(last_specified, components_.end(), Component::empty);
-
-    // Build insertion order.
-    this->insertion_order_ = perkInsertionOrder();
 }
 
 EquipmentType Gizmo::equipmentType() const {
-    return this->equipment_type_;
+    return static_cast<EquipmentType>(this->equipment_type_);
 }
 
 GizmoType Gizmo::type() const {
-    return this->gizmo_type_;
+    return static_cast<GizmoType>(this->gizmo_type_);
 }
 
 const std::array<Component, 9> &Gizmo::components() const {
@@ -73,7 +77,7 @@ std::array<Component, 9>::const_iterator Gizmo::begin() const {
 }
 
 std::array<Component, 9>::const_iterator Gizmo::end() const {
-    switch (gizmo_type_) {
+    switch (type()) {
         case STANDARD:
             return components_.begin() + 5;
         case ANCIENT:
@@ -92,11 +96,60 @@ GizmoResultProbabilityList Gizmo::targetPerkProbabilities(level_t invention_leve
     return gizmoResultProbabilities(invention_level, false, target, exact_target);
 }
 
+GizmoResultProbabilityList Gizmo::targetPerkProbabilities(level_t invention_level,
+                                                          const GizmoResult &target,
+                                                          const GizmoPrefixState &prefix_state,
+                                                          bool exact_target) const {
+    assert(prefix_state.insertionOrder() == perkInsertionOrder());
+    return gizmoResultProbabilities(invention_level, prefix_state.insertionOrder(), prefix_state.perkRollCdf(), false,
+                                    target, exact_target);
+}
+
+probability_t Gizmo::targetProbabilityUpperBound(level_t invention_level,
+                                                 const GizmoResult &target,
+                                                 const GizmoPrefixState &prefix_state) const {
+    return targetProbabilityUpperBound(inventionBudgetCdf(invention_level, type()), target,
+                                       prefix_state);
+}
+
+probability_t Gizmo::targetProbabilityUpperBound(const CDF &budget_cdf,
+                                                 const GizmoResult &target,
+                                                 const GizmoPrefixState &prefix_state) const {
+    assert(prefix_state.insertionOrder() == perkInsertionOrder());
+    PerkRankTable rank_probabilities;
+    perkRankProbabilities(prefix_state.insertionOrder(), prefix_state.perkRollCdf(), rank_probabilities);
+    return targetProbabilityUpperBound(budget_cdf, target, rank_probabilities);
+}
+
+probability_t Gizmo::targetProbability(level_t invention_level, const GizmoResult &target) const {
+    std::vector<Perk> insertion_order = perkInsertionOrder();
+    std::vector<std::shared_ptr<const CDF>> roll_cdfs = perkRollCdf(insertion_order);
+    PerkRankTable rank_probabilities;
+    perkRankProbabilities(insertion_order, cdfPointers(roll_cdfs), rank_probabilities);
+    return targetProbability(inventionBudgetCdf(invention_level, type()), target,
+                             rank_probabilities);
+}
+
+probability_t Gizmo::targetProbability(level_t invention_level,
+                                       const GizmoResult &target,
+                                       const GizmoPrefixState &prefix_state) const {
+    return targetProbability(inventionBudgetCdf(invention_level, type()), target, prefix_state);
+}
+
+probability_t Gizmo::targetProbability(const CDF &budget_cdf,
+                                       const GizmoResult &target,
+                                       const GizmoPrefixState &prefix_state) const {
+    assert(prefix_state.insertionOrder() == perkInsertionOrder());
+    PerkRankTable rank_probabilities;
+    perkRankProbabilities(prefix_state.insertionOrder(), prefix_state.perkRollCdf(), rank_probabilities);
+    return targetProbability(budget_cdf, target, rank_probabilities);
+}
+
 std::vector<Perk> Gizmo::perkInsertionOrder() const {
     std::bitset<std::numeric_limits<perk_id_t>::max()> perk_set;
     std::vector<Perk> insertion_order;
     std::for_each(begin(), end(), [&](const Component &comp) {
-        auto &component_perks = comp.perkContributions(this->equipment_type_);
+        auto &component_perks = comp.perkContributions(equipmentType());
         std::for_each(component_perks.begin(), component_perks.end(), [&](const PerkContribution &contrib) {
             if (!perk_set.test(contrib.perk.id)) {
                 insertion_order.push_back(Perk::get(contrib.perk.id));
@@ -107,81 +160,74 @@ std::vector<Perk> Gizmo::perkInsertionOrder() const {
     return insertion_order;
 }
 
-std::vector<CDF> Gizmo::perkRollCdf() const {
+std::vector<std::shared_ptr<const CDF>> Gizmo::perkRollCdf(const std::vector<Perk> &insertion_order) const {
     std::array<int, std::numeric_limits<perk_id_t>::max()> bases{};
     std::array<std::vector<int>, std::numeric_limits<perk_id_t>::max()> rolls{};
     std::for_each(begin(), end(), [&](const Component &comp) {
-        auto &component_perks = comp.perkContributions(this->equipment_type_);
+        auto &component_perks = comp.perkContributions(equipmentType());
         std::for_each(component_perks.begin(), component_perks.end(), [&](const PerkContribution &contrib) {
-            bases[contrib.perk.id] += (this->gizmo_type_ == ANCIENT && !comp.ancient()) ?
+            bases[contrib.perk.id] += (type() == ANCIENT && !comp.ancient()) ?
                                       0.8 * contrib.base : contrib.base;
-            rolls[contrib.perk.id].push_back((this->gizmo_type_ == ANCIENT && !comp.ancient()) ?
+            rolls[contrib.perk.id].push_back((type() == ANCIENT && !comp.ancient()) ?
                                              0.8 * contrib.roll : contrib.roll);
         });
     });
 
-    std::vector<CDF> cdfs;
-    cdfs.reserve(insertion_order_.size());
+    std::vector<std::shared_ptr<const CDF>> cdfs;
+    cdfs.reserve(insertion_order.size());
 
-    for (Perk perk : insertion_order_) {
-        CDF base_cdf = CDF(bases[perk.id], 0);
-        CDF perk_cdf = Cdf(rolls[perk.id]);
-        base_cdf.reserve(base_cdf.size() + perk_cdf.size());
-        base_cdf.insert(base_cdf.end(), perk_cdf.begin(), perk_cdf.end());
-        cdfs.emplace_back(std::move(base_cdf));
+    // The same base and rolls turn up across many gizmos, so they are looked up in the shared cache.
+    for (Perk perk : insertion_order) {
+        cdfs.push_back(RollCdfCache::shared().get(bases[perk.id], rolls[perk.id]));
     }
 
     return cdfs;
 }
 
-std::vector<std::vector<std::pair<rank_t, probability_t>>> Gizmo::perkRankProbabilities() const {
-    std::vector<std::vector<std::pair<rank_t, probability_t>>> rank_probabilities;
-    std::vector<Perk> insertion_order = this->insertion_order_;
-    std::vector<CDF> perk_contrib_cdf = perkRollCdf();
+void Gizmo::perkRankProbabilities(const std::vector<Perk> &insertion_order,
+                                  const std::vector<const CDF *> &perk_contrib_cdf,
+                                  PerkRankTable &rank_probabilities) const {
+    // Registering the components checks no gizmo can have more perks than this.
+    assert(insertion_order.size() <= PerkRankTable::max_perks);
+    rank_probabilities.perk_count = insertion_order.size();
 
     for (size_t i = 0; i < insertion_order.size(); ++i) {
         Perk perk = insertion_order[i];
-        const CDF &perk_cdf = perk_contrib_cdf[i];
+        rank_probabilities.perks[i] = perk;
+        const CDF &perk_cdf = *perk_contrib_cdf[i];
         const rank_list_t &ranks = perk.ranks();
-        std::vector<std::pair<rank_t, probability_t>> perk_rank_probabilities;
+        auto &perk_rank_probabilities = rank_probabilities.ranks[i];
+        uint8_t &rank_count = rank_probabilities.rank_counts[i];
+        rank_count = 0;
+
+        // Find the highest rank which is possible to generate. Thresholds increase with rank, and ranks only available
+        // on ancient gizmos are always the highest ones, so every rank below it is possible too.
+        size_t top_rank = perk.max_rank;
+        while (top_rank > 0 && (ranks[top_rank].threshold > perk_cdf.size() - 1 ||
+                                (ranks[top_rank].ancient && type() != ANCIENT))) {
+            top_rank--;
+        }
 
-        // Loop backwards through ranks.
-        for (size_t rank_i = perk.max_rank; rank_i > 0; --rank_i) {
-            rank_threshold_t threshold = ranks[rank_i].threshold;
-            // Is threshold greater or equal to the maximum possible generated contribution?
-            if (threshold > perk_cdf.size() - 1 ||
-                (ranks[rank_i].ancient && this->gizmo_type_ != ANCIENT)) {
-                // Cannot generate this perk.
-                continue;
-            }
+        // Calculate the probability the roll will fall between each rank's threshold and the rank above's threshold
+        // (or anywhere above it, for the top rank).
+        std::array<rank_threshold_t, rs::simd::max_thresholds> thresholds;
+        std::array<probability_t, rs::simd::max_thresholds> band_probabilities;
+        for (size_t rank_i = 1; rank_i <= top_rank; ++rank_i) {
+            thresholds[rank_i - 1] = ranks[rank_i].threshold;
+        }
+        rs::simd::thresholdDifferences(perk_cdf.data(), thresholds.data(), top_rank, band_probabilities.data());
 
-            // Calculate the probability the roll will fall between this threshold and the rank above's
-            // threshold.
-            probability_t rank_prob;
-            // Is this the first rank which is possible to generate?
-            if (rank_i == perk.max_rank ||
-                ranks[rank_i + 1].threshold > perk_cdf.size() - 1 ||
-                (this->gizmo_type_ != ANCIENT && ranks[rank_i + 1].ancient)) {
-                if (threshold > 0) {
-                    rank_prob = 1.0 - perk_cdf[threshold - 1];
-                } else {
-                    rank_prob = 1.0;
-                }
-            } else {
-                if (threshold > 0) {
-                    rank_prob = perk_cdf[ranks[rank_i + 1].threshold - 1] - perk_cdf[threshold - 1];
-                } else {
-                    rank_prob = perk_cdf[ranks[rank_i + 1].threshold - 1];
-                }
-            }
+        // Loop backwards through ranks.
+        for (size_t rank_i = top_rank; rank_i > 0; --rank_i) {
+            probability_t rank_prob = band_probabilities[rank_i - 1];
 
-            // Add this to vector.
+            // Add this to the table.
             if (rank_prob > 0) {
-                perk_rank_probabilities.emplace_back(ranks[rank_i].rank, rank_prob);
+                perk_rank_probabilities[rank_count++] = {ranks[rank_i].rank, rank_prob};
             }
 
             // If value of CDF at this threshold is zero, we know we can't generate any perks of lower rank.
-            if (perk_cdf[threshold] == 0) {
+            if (perk_cdf[ranks[rank_i].threshold] == 0) {
                 break;
             }
         }
@@ -190,39 +236,35 @@ std::vector<std::vector<std::pair<rank_t, probability_t>>> Gizmo::perkRankProbab
         // Add that probability now.
         if (ranks[1].threshold >= perk_cdf.size() || perk_cdf[ranks[1].threshold] > 0) {
             if (ranks[1].threshold >= perk_cdf.size()) {
-                perk_rank_probabilities.emplace_back(0, 1.0);
+                perk_rank_probabilities[rank_count++] = {0, 1.0};
             } else {
-                perk_rank_probabilities.emplace_back(0, perk_cdf[ranks[1].threshold - 1]);
+                perk_rank_probabilities[rank_count++] = {0, perk_cdf[ranks[1].threshold - 1]};
             }
         }
 
-        assert(perk_rank_probabilities.size() != 0);
-        rank_probabilities.emplace_back(perk_rank_probabilities);
+        assert(rank_count != 0);
     }
-
-    return rank_probabilities;
 }
 
-std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> Gizmo::perkCombinationProbabilities() const {
-    std::vector<std::vector<std::pair<rank_t, probability_t>>> perk_rank_probabilities = perkRankProbabilities();
-
+std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>>
+Gizmo::perkCombinationProbabilities(const PerkRankTable &perk_rank_probabilities) const {
     std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> perk_combinations;
     perk_combinations.reserve(1024);
 
     GeneratedPerk no_effect_result = {Perk::no_effect, 0};
 
-    std::vector<size_t> indices(perk_rank_probabilities.size(), 0);
-    while (indices[0] < perk_rank_probabilities[0].size()) {
+    std::vector<size_t> indices(perk_rank_probabilities.perk_count, 0);
+    while (indices[0] < perk_rank_probabilities.rank_counts[0]) {
         probability_t combined_prob = 1.0;
         size_t i = 0;
         std::vector<GeneratedPerk> combination;
-        combination.reserve(insertion_order_.size() + 1);
+        combination.reserve(perk_rank_probabilities.perk_count + 1);
         combination.emplace_back(no_effect_result);
-        for (i = 0; i < insertion_order_.size(); ++i) {
-            rank_t rank = perk_rank_probabilities[i][indices[i]].first;
-            probability_t rank_probability = perk_rank_probabilities[i][indices[i]].second;
+        for (i = 0; i < perk_rank_probabilities.perk_count; ++i) {
+            rank_t rank = perk_rank_probabilities.ranks[i][indices[i]].first;
+            probability_t rank_probability = perk_rank_probabilities.ranks[i][indices[i]].second;
             combined_prob *= rank_probability;
-            combination.emplace_back(insertion_order_[i], rank);
+            combination.emplace_back(perk_rank_probabilities.perks[i], rank);
         }
         rs::safeQuicksort(1, combination.size() - 1, combination,
                           [](const GeneratedPerk &a) -> int { return static_cast<int>(a.cost); });
@@ -231,7 +273,7 @@ std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> Gizmo::perkCom
         // Increment indices.
         for (i = indices.size() - 1; i < indices.size(); --i) {
             indices[i]++;
-            if (indices[i] == perk_rank_probabilities[i].size()) {
+            if (indices[i] == perk_rank_probabilities.rank_counts[i]) {
                 if (i == 0) {
                     break;
                 }
@@ -245,68 +287,380 @@ std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> Gizmo::perkCom
     return perk_combinations;
 }
 
-[[maybe_unused]] std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>>
-Gizmo::perkCombinationProbabilities(const GizmoResult &target, bool exact) const {
-    std::vector<std::vector<std::pair<rank_t, probability_t>>> perk_rank_probabilities = perkRankProbabilities();
+void Gizmo::anyPairTerms(const PerkRankTable &perk_rank_probabilities, AnyPairTerms &terms) const {
+    // Walking the sorted pairs of a combination, the budget interval only closes when it reaches the cheapest
+    // non-zero perk paired with nothing. So a combination generates some pair with probability
+    // 1 - B(cheapest perk cost), which only depends on the distribution of that minimum cost.
+    std::array<size_t, PerkRankTable::max_perks * PerkRankTable::max_ranks> costs;
+    size_t cost_count = 0;
+    for (size_t i = 0; i < perk_rank_probabilities.perk_count; ++i) {
+        for (size_t rank_i = 0; rank_i < perk_rank_probabilities.rank_counts[i]; ++rank_i) {
+            rank_t rank = perk_rank_probabilities.ranks[i][rank_i].first;
+            if (rank != 0) {
+                costs[cost_count++] = perk_rank_probabilities.perks[i].rank(rank).cost;
+            }
+        }
+    }
+    std::sort(costs.begin(), costs.begin() + cost_count);
+    cost_count = std::unique(costs.begin(), costs.begin() + cost_count) - costs.begin();
+
+    terms.count = 0;
+    probability_t min_cost_above_previous = 1.0;
+    for (size_t cost_i = 0; cost_i < cost_count; ++cost_i) {
+        size_t cost = costs[cost_i];
+        // P(every perk is either rank zero or costs more than this).
+        probability_t min_cost_above = 1.0;
+        for (size_t i = 0; i < perk_rank_probabilities.perk_count; ++i) {
+            probability_t at_or_below = 0.0;
+            for (size_t rank_i = 0; rank_i < perk_rank_probabilities.rank_counts[i]; ++rank_i) {
+                const auto &rank_probability = perk_rank_probabilities.ranks[i][rank_i];
+                if (rank_probability.first != 0 &&
+                    perk_rank_probabilities.perks[i].rank(rank_probability.first).cost <= cost) {
+                    at_or_below += rank_probability.second;
+                }
+            }
+            min_cost_above *= 1.0 - at_or_below;
+        }
+
+        terms.terms[terms.count++] = {cost, min_cost_above_previous - min_cost_above};
+        min_cost_above_previous = min_cost_above;
+    }
+}
+
+probability_t Gizmo::anyPairProbability(const CDF &budget_cdf, const PerkRankTable &perk_rank_probabilities) const {
+    AnyPairTerms terms;
+    anyPairTerms(perk_rank_probabilities, terms);
+    return terms.probability(budget_cdf);
+}
 
-    std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> perk_combinations;
-    perk_combinations.reserve(1024);
+probability_t Gizmo::targetRankProbability(const GizmoResult &target,
+                                           const PerkRankTable &perk_rank_probabilities,
+                                           size_t &target_cost) const {
+    // The target perks must roll exactly their target ranks.
+    probability_t target_rank_probability = 1.0;
+    target_cost = 0;
+    for (const GeneratedPerk &target_perk : {target.first, target.second}) {
+        if (target_perk.perk.id == no_effect_id) {
+            continue;
+        }
 
-    std::vector<size_t> indices(perk_rank_probabilities.size());
-    while (indices[0] < perk_rank_probabilities[0].size()) {
-        probability_t combined_prob = 1.0;
-        size_t i = 0;
-        std::vector<GeneratedPerk> combination;
-        combination.reserve(insertion_order_.size());
-        for (i = 0; i < insertion_order_.size(); ++i) {
-            rank_t rank = perk_rank_probabilities[i][indices[i]].first;
+        auto perks_end = perk_rank_probabilities.perks.begin() + perk_rank_probabilities.perk_count;
+        auto found = std::find(perk_rank_probabilities.perks.begin(), perks_end, target_perk.perk);
+        if (found == perks_end) {
+            return 0;
+        }
+        size_t perk_i = found - perk_rank_probabilities.perks.begin();
+        const auto &rank_probabilities = perk_rank_probabilities.ranks[perk_i];
+        auto rank_probabilities_end = rank_probabilities.begin() + perk_rank_probabilities.rank_counts[perk_i];
+        auto found_rank = std::find_if(rank_probabilities.begin(), rank_probabilities_end,
+                                       [&](const std::pair<rank_t, probability_t> &rank_probability) {
+                                           return rank_probability.first == target_perk.rank;
+                                       });
+        if (found_rank == rank_probabilities_end) {
+            return 0;
+        }
+
+        target_rank_probability *= found_rank->second;
+        target_cost += target_perk.cost;
+    }
+
+    return target_rank_probability;
+}
+
+namespace {
+    // The target probability is P(target pair generated) / P(any pair generated), as in gizmoResultProbabilities.
+    // For the bound, the numerator only needs the target perks to roll their target ranks and the budget to exceed
+    // the pair's cost.
+    probability_t targetUpperBound(const CDF &budget_cdf, probability_t target_rank_probability, size_t target_cost,
+                                   probability_t any_pair_probability) {
+        if (any_pair_probability <= 0) {
+            return 0;
+        }
+        probability_t target_upper = target_rank_probability * (1.0 - budget_cdf[target_cost]);
+
+        // Denominator: exact up to rounding, so allow a little slack to keep the bound admissible.
+        return std::min(1.0, target_upper / any_pair_probability * (1.0 + 1e-9));
+    }
+}
+
+probability_t Gizmo::targetProbabilityUpperBound(const CDF &budget_cdf,
+                                                 const GizmoResult &target,
+                                                 const PerkRankTable &perk_rank_probabilities) const {
+    size_t target_cost;
+    probability_t target_rank_probability = targetRankProbability(target, perk_rank_probabilities, target_cost);
+    if (target_rank_probability == 0 || target_cost >= budget_cdf.size() - 1) {
+        return 0;
+    }
+
+    return targetUpperBound(budget_cdf, target_rank_probability, target_cost,
+                            anyPairProbability(budget_cdf, perk_rank_probabilities));
+}
+
+probability_t Gizmo::targetProbability(const CDF &budget_cdf,
+                                       const GizmoResult &target,
+                                       const PerkRankTable &perk_rank_probabilities) const {
+    probability_t any_pair_probability = anyPairProbability(budget_cdf, perk_rank_probabilities);
+    if (any_pair_probability <= 0) {
+        return 0;
+    }
+
+    return targetPairProbability(budget_cdf, target, perk_rank_probabilities) / any_pair_probability;
+}
+
+void Gizmo::distribution(const GizmoPrefixState &prefix_state, GizmoDistribution &distribution) const {
+    assert(prefix_state.insertionOrder() == perkInsertionOrder());
+    perkRankProbabilities(prefix_state.insertionOrder(), prefix_state.perkRollCdf(), distribution.rank_probabilities);
+    anyPairTerms(distribution.rank_probabilities, distribution.any_pair);
+}
+
+probability_t Gizmo::targetProbability(const CDF &budget_cdf,
+                                       const GizmoResult &target,
+                                       const GizmoDistribution &distribution) const {
+    probability_t any_pair_probability = distribution.any_pair.probability(budget_cdf);
+    if (any_pair_probability <= 0) {
+        return 0;
+    }
+
+    return targetPairProbability(budget_cdf, target, distribution.rank_probabilities) / any_pair_probability;
+}
+
+probability_t Gizmo::targetProbabilityUpperBound(const CDF &budget_cdf,
+                                                 const GizmoResult &target,
+                                                 const GizmoDistribution &distribution) const {
+    size_t target_cost;
+    probability_t target_rank_probability = targetRankProbability(target, distribution.rank_probabilities,
+                                                                  target_cost);
+    if (target_rank_probability == 0 || target_cost >= budget_cdf.size() - 1) {
+        return 0;
+    }
+
+    return targetUpperBound(budget_cdf, target_rank_probability, target_cost,
+                            distribution.any_pair.probability(budget_cdf));
+}
+
+void Gizmo::targetProbabilityTerms(const GizmoResult &target,
+                                   const GizmoPrefixState &prefix_state,
+                                   TargetProbabilityTerms &terms) const {
+    assert(prefix_state.insertionOrder() == perkInsertionOrder());
+    perkRankProbabilities(prefix_state.insertionOrder(), prefix_state.perkRollCdf(), terms.rank_probabilities_);
+    terms.target_rank_probability_ = targetRankProbability(target, terms.rank_probabilities_, terms.target_cost_);
+    anyPairTerms(terms.rank_probabilities_, terms.any_pair_);
+    terms.target_pairs_.clear();
+    terms.has_target_pairs_ = false;
+}
+
+void Gizmo::targetPairTerms(const GizmoResult &target, TargetProbabilityTerms &terms) const {
+    terms.target_pairs_.clear();
+    // With no budget cap, every pair the walk could reach at any level is kept. Any interval above a level's
+    // maximum budget clamps to nothing there, giving the same sum as the walk at that level.
+    walkTargetPairs(target, terms.rank_probabilities_, std::numeric_limits<size_t>::max(),
+                    [&](probability_t combined_prob, size_t low, size_t high, bool is_target) {
+                        if (is_target) {
+                            terms.target_pairs_.push_back({combined_prob, low, high});
+                        }
+                        return true;
+                    });
+    terms.has_target_pairs_ = true;
+}
+
+probability_t AnyPairTerms::probability(const CDF &budget_cdf) const {
+    size_t max_budget = budget_cdf.size() - 1;
+    probability_t any_pair_probability = 0.0;
+    for (size_t term_i = 0; term_i < count; ++term_i) {
+        any_pair_probability += terms[term_i].probability *
+                                (1.0 - budget_cdf[std::min(terms[term_i].cost, max_budget)]);
+    }
+    return any_pair_probability;
+}
+
+probability_t TargetProbabilityTerms::upperBound(const CDF &budget_cdf) const {
+    if (target_rank_probability_ == 0 || target_cost_ >= budget_cdf.size() - 1) {
+        return 0;
+    }
+    return targetUpperBound(budget_cdf, target_rank_probability_, target_cost_, any_pair_.probability(budget_cdf));
+}
 
-            if (insertion_order_[i] == target.first.perk) {
-                if ((exact && rank != target.first.rank) || rank < target.first.rank) {
-                    goto skip;
+probability_t TargetProbabilityTerms::probability(const CDF &budget_cdf) const {
+    assert(has_target_pairs_);
+    probability_t any_pair_probability = any_pair_.probability(budget_cdf);
+    if (any_pair_probability <= 0) {
+        return 0;
+    }
+
+    size_t max_budget = budget_cdf.size() - 1;
+    probability_t target_probability = 0.0;
+    for (const TargetPairInterval &interval : target_pairs_) {
+        probability_t combo_probability = budget_cdf[std::min(interval.high, max_budget)] -
+                                          budget_cdf[std::min(interval.low, max_budget)];
+        target_probability += interval.probability * combo_probability;
+    }
+    return target_probability / any_pair_probability;
+}
+
+namespace {
+    // Plain perk/rank/cost triple, so a whole combination can live in a fixed size buffer.
+    struct CombinationPerk {
+        Perk perk;
+        rank_t rank;
+        rank_cost_t cost;
+    };
+
+    // One more than the maximum number of perks, for the leading no effect.
+    constexpr size_t max_combination_perks = PerkRankTable::max_perks + 1;
+}
+
+template<typename F>
+void Gizmo::walkTargetPairs(const GizmoResult &target,
+                            const PerkRankTable &perk_rank_probabilities,
+                            size_t max_cost,
+                            F interval) const {
+    size_t perk_count = perk_rank_probabilities.perk_count;
+    if (perk_count == 0 || target.first.perk.id == no_effect_id) {
+        return;
+    }
+    assert(perk_count < max_combination_perks);
+
+    // Only pairs made of exactly the target perks at their target ranks can match, so each target perk is fixed
+    // to that rank rather than being iterated over.
+    // Any other perk which rolls a cost above both target perks is sorted after them, so its pair with no effect
+    // is reached first. If that cost is also no more than the target pair's cost, the budget interval has already
+    // closed below the target pair, so that rank can be skipped entirely. This only holds when the target is a
+    // genuine pair, as pairs containing two-slot perks are reduced to a single perk.
+    size_t target_max_cost = std::max(target.first.cost, target.second.cost);
+    size_t target_pair_cost = target.first.cost + target.second.cost;
+    bool skip_closing_ranks = target.second.perk.id != no_effect_id &&
+                              !target.first.perk.twoSlot() &&
+                              !target.second.perk.twoSlot();
+
+    PerkRankTable choices;
+    choices.perk_count = perk_count;
+    choices.perks = perk_rank_probabilities.perks;
+    for (size_t i = 0; i < perk_count; ++i) {
+        const Perk &perk = perk_rank_probabilities.perks[i];
+        choices.rank_counts[i] = 0;
+        for (size_t rank_i = 0; rank_i < perk_rank_probabilities.rank_counts[i]; ++rank_i) {
+            const auto &rank_probability = perk_rank_probabilities.ranks[i][rank_i];
+            if (perk == target.first.perk || perk == target.second.perk) {
+                const GeneratedPerk &target_perk = perk == target.first.perk ? target.first : target.second;
+                if (rank_probability.first != target_perk.rank) {
+                    continue;
                 }
-            }
-            if (insertion_order_[i] == target.second.perk) {
-                if ((exact && rank != target.second.rank) || rank < target.second.rank) {
-                    goto skip;
+            } else if (skip_closing_ranks && rank_probability.first != 0) {
+                size_t cost = perk.rank(rank_probability.first).cost;
+                if (cost > target_max_cost && cost <= target_pair_cost) {
+                    continue;
                 }
             }
+            choices.ranks[i][choices.rank_counts[i]++] = rank_probability;
+        }
 
-            probability_t rank_probability = perk_rank_probabilities[i][indices[i]].second;
-            combined_prob *= rank_probability;
-            combination.emplace_back(insertion_order_[i], rank);
+        if (choices.rank_counts[i] == 0) {
+            // The target cannot be generated.
+            return;
         }
-        perk_combinations.emplace_back(std::move(combination), combined_prob);
+    }
+
+    std::array<CombinationPerk, max_combination_perks> combination;
+    combination[0] = {Perk::no_effect, 0, 0};
+
+    std::array<size_t, max_combination_perks> indices{};
+    while (indices[0] < choices.rank_counts[0]) {
+        probability_t combined_prob = 1.0;
+        for (size_t i = 0; i < perk_count; ++i) {
+            rank_t rank = choices.ranks[i][indices[i]].first;
+            combined_prob *= choices.ranks[i][indices[i]].second;
+            combination[i + 1] = {choices.perks[i], rank, choices.perks[i].rank(rank).cost};
+        }
+        rs::safeQuicksort(1, perk_count, combination,
+                          [](const CombinationPerk &a) -> int { return static_cast<int>(a.cost); });
+
+        // Walk the pairs as in gizmoResultProbabilities, handing each budget interval to the caller, which can stop
+        // the walk of this combination by returning false.
+        size_t prev_cost = max_cost;
+        for (size_t i = perk_count; i > 0; --i) {
+            if (combination[i].rank == 0) {
+                continue;
+            }
+
+            for (size_t j = i - 1; j < i; --j) {
+                size_t combo_cost = combination[i].cost + combination[j].cost;
+                if (combo_cost >= prev_cost) {
+                    continue;
+                }
+
+                GizmoResult perk_pair = {{combination[i].perk, combination[i].rank},
+                                         {combination[j].perk, combination[j].rank}};
+                if (perk_pair.first.perk.twoSlot()) {
+                    perk_pair.second = {Perk::no_effect, 0};
+                }
+                if (perk_pair.second.perk.twoSlot()) {
+                    perk_pair.first = perk_pair.second;
+                    perk_pair.second = {Perk::no_effect, 0};
+                }
+
+                if (!interval(combined_prob, combo_cost, prev_cost, perk_pair == target)) {
+                    goto next_combination;
+                }
+                prev_cost = combo_cost;
+            }
+        }
+        next_combination:
 
         // Increment indices.
-        skip:
-        for (i = indices.size() - 1; i < indices.size(); --i) {
+        for (size_t i = perk_count - 1; i < perk_count; --i) {
             indices[i]++;
-            if (indices[i] == perk_rank_probabilities[i].size()) {
+            if (indices[i] == choices.rank_counts[i]) {
                 if (i == 0) {
                     break;
                 }
-
                 indices[i] = 0;
                 continue;
             }
-
             break;
         }
     }
+}
 
-    return perk_combinations;
+probability_t Gizmo::targetPairProbability(const CDF &budget_cdf,
+                                           const GizmoResult &target,
+                                           const PerkRankTable &perk_rank_probabilities) const {
+    probability_t target_probability = 0.0;
+    walkTargetPairs(target, perk_rank_probabilities, budget_cdf.size() - 1,
+                    [&](probability_t combined_prob, size_t low, size_t high, bool is_target) {
+                        probability_t combo_probability = budget_cdf[high] - budget_cdf[low];
+                        if (combo_probability == 0) {
+                            return false;
+                        }
+                        if (is_target) {
+                            target_probability += combined_prob * combo_probability;
+                        }
+                        return true;
+                    });
+    return target_probability;
 }
 
+GizmoResultProbabilityList Gizmo::gizmoResultProbabilities(level_t invention_level,
+                                                           bool include_no_effect,
+                                                           GizmoResult target,
+                                                           bool exact_target) const {
+    std::vector<Perk> insertion_order = perkInsertionOrder();
+    std::vector<std::shared_ptr<const CDF>> roll_cdfs = perkRollCdf(insertion_order);
+    return gizmoResultProbabilities(invention_level, insertion_order, cdfPointers(roll_cdfs), include_no_effect,
+                                    target, exact_target);
+}
 
 GizmoResultProbabilityList Gizmo::gizmoResultProbabilities(level_t invention_level,
+                                                           const std::vector<Perk> &insertion_order,
+                                                           const std::vector<const CDF *> &perk_contrib_cdf,
                                                            bool include_no_effect,
                                                            GizmoResult target,
                                                            bool exact_target) const {
     GizmoResultProbabilityList results;
     std::unordered_map<GizmoResult, probability_t, GizmoResultHash> result_total_probabilities;
-    auto perk_combination_probabilities = perkCombinationProbabilities();
-    CDF budget_cdf = inventionBudgetCdf(invention_level, this->gizmo_type_ == ANCIENT);
+    PerkRankTable rank_probabilities;
+    perkRankProbabilities(insertion_order, perk_contrib_cdf, rank_probabilities);
+    auto perk_combination_probabilities = perkCombinationProbabilities(rank_probabilities);
+    const CDF &budget_cdf = inventionBudgetCdf(invention_level, type());
     GeneratedPerk no_effect_result = {Perk::no_effect, 0};
 
     bool check_target = target.first.perk.id != no_effect_id;
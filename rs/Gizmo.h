@@ -10,7 +10,10 @@
 #include "Component.h"
 #include "Perk.h"
 #include "Probability.h"
+#include "SimdKernels.h"
 #include <array>
+#include <memory>
+#include <type_traits>
 #include <vector>
 
 
@@ -22,6 +25,9 @@ struct GizmoResult {
     GizmoResult(GeneratedPerk first, GeneratedPerk second);
 
     bool operator==(const GizmoResult &other) const;
+
+    // One byte each for the perk IDs and ranks, so distinct results have distinct keys.
+    [[nodiscard]] uint32_t key() const;
 };
 
 struct GizmoResultHash {
@@ -41,11 +47,80 @@ std::ostream &operator<<(std::ostream &strm, const GizmoResultProbability &gizmo
 // Gizmos can produce a series of possible results with probabilities.
 typedef std::vector<GizmoResultProbability> GizmoResultProbabilityList;
 
+class GizmoPrefixState;
+
+// Probability of each rank for every perk of a gizmo, in insertion order. Held in fixed size buffers, so candidates
+// can be evaluated without any heap allocations. The perks themselves are kept alongside, so nothing further down the
+// calculation needs the gizmo's insertion order.
+struct PerkRankTable {
+    // No gizmo can have more possible perks than this, which Component checks when the data is registered.
+    static constexpr size_t max_perks = 64;
+    // Every rank of a perk, including zero.
+    static constexpr size_t max_ranks = std::tuple_size<rank_list_t>::value;
+    static_assert(max_ranks - 1 <= rs::simd::max_thresholds, "Every non-zero rank needs a threshold");
+
+    size_t perk_count = 0;
+    std::array<Perk, max_perks> perks;
+    std::array<uint8_t, max_perks> rank_counts;
+    std::array<std::array<std::pair<rank_t, probability_t>, max_ranks>, max_perks> ranks;
+};
+
+// P(any pair is generated) split into the probability of each cheapest non-zero perk cost, ascending by cost, so it
+// can be evaluated against any invention budget.
+struct AnyPairTerms {
+    struct CostTerm {
+        size_t cost;
+        probability_t probability;
+    };
+
+    size_t count = 0;
+    std::array<CostTerm, PerkRankTable::max_perks * PerkRankTable::max_ranks> terms;
+
+    [[nodiscard]] probability_t probability(const CDF &budget_cdf) const;
+};
+
+// The parts of a gizmo's target probability which depend on neither the target nor the invention level. Equal normal
+// form gizmos have equal distributions, so one can be reused for any target and level (see DistributionCache).
+struct GizmoDistribution {
+    PerkRankTable rank_probabilities;
+    AnyPairTerms any_pair;
+};
+
+// The parts of a gizmo's target probability which do not depend on the invention level. Once built, they can be
+// evaluated against the budget CDF of any level, giving what targetProbabilityUpperBound and targetProbability give
+// at that level, up to rounding. Reusing one instance keeps its buffers, so rebuilding it stops allocating.
+class TargetProbabilityTerms {
+public:
+    [[nodiscard]] probability_t upperBound(const CDF &budget_cdf) const;
+
+    // Needs the target pair terms, from Gizmo::targetPairTerms.
+    [[nodiscard]] probability_t probability(const CDF &budget_cdf) const;
+
+private:
+    friend class Gizmo;
+
+    // The target pair is generated with the given probability when the budget falls in [low, high).
+    struct TargetPairInterval {
+        probability_t probability;
+        size_t low;
+        size_t high;
+    };
+
+    PerkRankTable rank_probabilities_;
+    probability_t target_rank_probability_ = 0;
+    size_t target_cost_ = 0;
+    AnyPairTerms any_pair_;
+    std::vector<TargetPairInterval> target_pairs_;
+    bool has_target_pairs_ = false;
+};
+
+// A plain value holding only the equipment type, gizmo type and component IDs, so lists of candidates are contiguous
+// and copying one never allocates. The perk insertion order is worked out from the components when it is needed.
 class Gizmo {
 public:
     Gizmo() = delete;
 
-    Gizmo(EquipmentType equipment_type, GizmoType gizmo_type, std::vector<Component> components);
+    Gizmo(EquipmentType equipment_type, GizmoType gizmo_type, const std::vector<Component> &components);
 
     EquipmentType equipmentType() const;
 
@@ -67,30 +142,126 @@ public:
                                                        const GizmoResult &target,
                                                        bool exact_target = true) const;
 
+    // As above, but reuses the perk distributions already built up in a prefix state holding this gizmo.
+    GizmoResultProbabilityList targetPerkProbabilities(level_t invention_level,
+                                                       const GizmoResult &target,
+                                                       const GizmoPrefixState &prefix_state,
+                                                       bool exact_target = true) const;
+
+    // Total probability of targetPerkProbabilities (with an exact target), evaluated directly. Only combinations in
+    // which the target perks roll their target ranks are enumerated, and no per-combination vectors are built.
+    probability_t targetProbability(level_t invention_level, const GizmoResult &target) const;
+
+    probability_t targetProbability(level_t invention_level,
+                                    const GizmoResult &target,
+                                    const GizmoPrefixState &prefix_state) const;
+
+    // An upper bound on the total probability of targetPerkProbabilities, from the perk rank probabilities alone.
+    // Much cheaper than the full calculation, as no perk combinations are enumerated. Zero if the target cannot be
+    // generated.
+    probability_t targetProbabilityUpperBound(level_t invention_level,
+                                              const GizmoResult &target,
+                                              const GizmoPrefixState &prefix_state) const;
+
+    // As above, but with the invention budget CDF already looked up by the caller. Neither of these allocate.
+    probability_t targetProbability(const CDF &budget_cdf,
+                                    const GizmoResult &target,
+                                    const GizmoPrefixState &prefix_state) const;
+
+    probability_t targetProbabilityUpperBound(const CDF &budget_cdf,
+                                              const GizmoResult &target,
+                                              const GizmoPrefixState &prefix_state) const;
+
+    // Level-independent terms of the two above, for evaluating many invention levels at once. This builds enough for
+    // the upper bound; targetPairTerms then adds what the exact probability needs, which costs as much as a full
+    // evaluation, so it is worth skipping when every level's bound is already too low.
+    void targetProbabilityTerms(const GizmoResult &target,
+                                const GizmoPrefixState &prefix_state,
+                                TargetProbabilityTerms &terms) const;
+
+    void targetPairTerms(const GizmoResult &target, TargetProbabilityTerms &terms) const;
+
+    // Builds the distribution of this gizmo, from a prefix state holding it.
+    void distribution(const GizmoPrefixState &prefix_state, GizmoDistribution &distribution) const;
+
+    // As the prefix state versions, from this gizmo's distribution, with exactly the same results.
+    probability_t targetProbability(const CDF &budget_cdf,
+                                    const GizmoResult &target,
+                                    const GizmoDistribution &distribution) const;
+
+    probability_t targetProbabilityUpperBound(const CDF &budget_cdf,
+                                              const GizmoResult &target,
+                                              const GizmoDistribution &distribution) const;
+
 private:
-    EquipmentType equipment_type_;
-    GizmoType gizmo_type_;
+    // Times the individual stages of the calculation.
+    friend struct GizmoBenchmarks;
+
     std::array<Component, 9> components_;
-    std::vector<Perk> insertion_order_;
+    uint8_t equipment_type_;
+    uint8_t gizmo_type_;
 
     std::vector<Perk> perkInsertionOrder() const;
 
-    std::vector<CDF> perkRollCdf() const;
+    // Roll CDF of each perk, in the given insertion order. The CDFs are shared with RollCdfCache, so one already cached
+    // is neither recomputed nor copied.
+    std::vector<std::shared_ptr<const CDF>> perkRollCdf(const std::vector<Perk> &insertion_order) const;
 
-    std::vector<std::vector<std::pair<rank_t, probability_t>>> perkRankProbabilities() const;
+    void perkRankProbabilities(const std::vector<Perk> &insertion_order,
+                               const std::vector<const CDF *> &perk_contrib_cdf,
+                               PerkRankTable &rank_probabilities) const;
 
-    std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>> perkCombinationProbabilities() const;
+    std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>>
+    perkCombinationProbabilities(const PerkRankTable &perk_rank_probabilities) const;
 
-    [[maybe_unused]] std::vector<std::pair<std::vector<GeneratedPerk>, probability_t>>
-    perkCombinationProbabilities(const GizmoResult &target, bool exact = true) const;
+    // P(any pair is generated), the normalisation divisor of gizmoResultProbabilities, in closed form.
+    probability_t anyPairProbability(const CDF &budget_cdf, const PerkRankTable &perk_rank_probabilities) const;
+
+    void anyPairTerms(const PerkRankTable &perk_rank_probabilities, AnyPairTerms &terms) const;
+
+    // P(the target perks roll their target ranks), with the cost of the target pair. Zero if they cannot.
+    probability_t targetRankProbability(const GizmoResult &target,
+                                        const PerkRankTable &perk_rank_probabilities,
+                                        size_t &target_cost) const;
+
+    // P(the target pair is generated), before normalisation.
+    probability_t targetPairProbability(const CDF &budget_cdf,
+                                        const GizmoResult &target,
+                                        const PerkRankTable &perk_rank_probabilities) const;
+
+    // Walks the pairs of every combination in which the target perks roll their target ranks, calling
+    // interval(combination probability, low, high, is target pair) with the budget interval [low, high) each pair is
+    // generated in, starting from max_cost. Returning false skips the rest of that combination.
+    template<typename F>
+    void walkTargetPairs(const GizmoResult &target,
+                         const PerkRankTable &perk_rank_probabilities,
+                         size_t max_cost,
+                         F interval) const;
+
+    probability_t targetProbability(const CDF &budget_cdf,
+                                    const GizmoResult &target,
+                                    const PerkRankTable &perk_rank_probabilities) const;
+
+    probability_t targetProbabilityUpperBound(const CDF &budget_cdf,
+                                              const GizmoResult &target,
+                                              const PerkRankTable &perk_rank_probabilities) const;
 
     GizmoResultProbabilityList gizmoResultProbabilities(level_t invention_level,
                                                         bool include_no_effect = false,
                                                         GizmoResult target = {{Perk::no_effect, 0},
                                                                               {Perk::no_effect, 0}},
                                                         bool exact_target = true) const;
+
+    GizmoResultProbabilityList gizmoResultProbabilities(level_t invention_level,
+                                                        const std::vector<Perk> &insertion_order,
+                                                        const std::vector<const CDF *> &perk_contrib_cdf,
+                                                        bool include_no_effect,
+                                                        GizmoResult target,
+                                                        bool exact_target) const;
 };
 
+static_assert(std::is_trivially_copyable_v<Gizmo>, "Candidate lists are copied as plain memory");
+
 std::ostream &operator<<(std::ostream &strm, const Gizmo &gizmo);
 
 
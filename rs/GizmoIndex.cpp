@@ -0,0 +1,316 @@
+#include "GizmoIndex.h"
+#include "OptimalGizmoSearch.h"
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cmath>
+#include <map>
+#include <set>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+
+
+struct GizmoIndex::Header {
+    MappedFormat<3> format;
+    uint8_t equipment_type;
+    uint8_t gizmo_type;
+    level_t invention_level;
+    uint8_t padding[5];
+    uint64_t size;
+    uint64_t data_hash;
+    // Bitmap of the indexed perk IDs.
+    std::array<uint64_t, 4> perks;
+    Section gizmos;
+    Section results;
+    Section entries;
+};
+
+namespace {
+    constexpr MappedFormat<3> index_format = {
+            {'R', 'S', 'G', 'I'}, 1, MappedFormat<3>::byte_order_mark,
+            {sizeof(GizmoIndex::GizmoRecord), sizeof(GizmoIndex::ResultRecord), sizeof(GizmoIndex::EntryRecord)}};
+
+    static_assert(std::is_trivially_copyable_v<GizmoIndex::ResultRecord> &&
+                  std::is_trivially_copyable_v<GizmoIndex::EntryRecord>,
+                  "Index records are used in place, so must be trivially copyable");
+
+    bool testPerk(const std::array<uint64_t, 4> &perks, perk_id_t perk) {
+        return (perks[perk / 64] >> (perk % 64)) & 1;
+    }
+
+    GizmoIndex::GizmoRecord gizmoRecord(const Gizmo &gizmo) {
+        GizmoIndex::GizmoRecord record{};
+        for (size_t slot = 0; slot < record.size(); ++slot) {
+            record[slot] = gizmo.components()[slot].id;
+        }
+        return record;
+    }
+
+    Gizmo recordGizmo(EquipmentType equipment_type, GizmoType gizmo_type, const GizmoIndex::GizmoRecord &record) {
+        std::vector<Component> components;
+        for (size_t slot = 0; slot < slotsForType(gizmo_type); ++slot) {
+            components.push_back(record[slot] == empty_component_id ? Component::empty : Component::get(record[slot]));
+        }
+        return Gizmo(equipment_type, gizmo_type, components);
+    }
+
+    // Best first, ties in the order the gizmos were enumerated, so building is deterministic.
+    bool betterEntry(const GizmoIndex::EntryRecord &a, const GizmoIndex::EntryRecord &b) {
+        return a.probability > b.probability || (a.probability == b.probability && a.gizmo < b.gizmo);
+    }
+}
+
+GizmoIndex::GizmoIndex(std::unique_ptr<MappedFile> file) :
+        file_(std::move(file)),
+        data_(file_->data()),
+        size_(file_->size()) {
+
+}
+
+EquipmentType GizmoIndex::equipmentType() const {
+    return static_cast<EquipmentType>(header().equipment_type);
+}
+
+GizmoType GizmoIndex::gizmoType() const {
+    return static_cast<GizmoType>(header().gizmo_type);
+}
+
+level_t GizmoIndex::inventionLevel() const {
+    return header().invention_level;
+}
+
+uint64_t GizmoIndex::dataHash() const {
+    return header().data_hash;
+}
+
+std::vector<Perk> GizmoIndex::perks() const {
+    std::vector<Perk> indexed_perks;
+    for (const Perk &perk : Perk::all()) {
+        if (perk.id != no_effect_id && indexed(perk.id)) {
+            indexed_perks.push_back(perk);
+        }
+    }
+    return indexed_perks;
+}
+
+bool GizmoIndex::covers(const GizmoResult &target) const {
+    return indexed(target.first.perk.id) && indexed(target.second.perk.id);
+}
+
+GizmoIndex::Records<GizmoIndex::EntryRecord> GizmoIndex::results(const GizmoResult &target) const {
+    const auto *result_records = section<ResultRecord>(header().results);
+    const ResultRecord *result_end = result_records + header().results.count;
+    uint32_t key = target.key();
+    const ResultRecord *found = std::lower_bound(result_records, result_end, key,
+                                                 [](const ResultRecord &record, uint32_t key) {
+                                                     return record.key < key;
+                                                 });
+    const auto *entry_records = section<EntryRecord>(header().entries);
+    if (found == result_end || found->key != key) {
+        return {entry_records, 0};
+    }
+    return {entry_records + found->offset, found->count};
+}
+
+Gizmo GizmoIndex::gizmo(const EntryRecord &entry) const {
+    return recordGizmo(equipmentType(), gizmoType(), section<GizmoRecord>(header().gizmos)[entry.gizmo]);
+}
+
+size_t GizmoIndex::gizmoCount() const {
+    return header().gizmos.count;
+}
+
+size_t GizmoIndex::resultCount() const {
+    return header().results.count;
+}
+
+size_t GizmoIndex::entryCount() const {
+    return header().entries.count;
+}
+
+const GizmoIndex::Header &GizmoIndex::header() const {
+    return *reinterpret_cast<const Header *>(data_);
+}
+
+template<typename T>
+const T *GizmoIndex::section(const Section &section) const {
+    return reinterpret_cast<const T *>(data_ + section.offset);
+}
+
+bool GizmoIndex::indexed(perk_id_t perk) const {
+    // No effect stands in for the missing second perk of a single perk target, so is always covered.
+    return perk == no_effect_id || testPerk(header().perks, perk);
+}
+
+bool GizmoIndex::valid() const {
+    if (size_ < sizeof(Header)) {
+        return false;
+    }
+    const Header &index_header = header();
+    if (!(index_header.format == index_format) || index_header.size != size_ ||
+        index_header.equipment_type >= EquipmentType::SIZE || index_header.gizmo_type > ANCIENT) {
+        return false;
+    }
+
+    if (!index_header.gizmos.fits(size_, sizeof(GizmoRecord)) ||
+        !index_header.results.fits(size_, sizeof(ResultRecord)) ||
+        !index_header.entries.fits(size_, sizeof(EntryRecord)) ||
+        index_header.gizmos.count > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+
+    // Lookups use the records without further checks, so everything has to refer to something registered, or to
+    // something else within the index.
+    std::bitset<std::numeric_limits<perk_id_t>::max() + 1> perk_ids;
+    for (const Perk &perk : Perk::all()) {
+        perk_ids.set(perk.id);
+    }
+    for (size_t perk = 0; perk < perk_ids.size(); ++perk) {
+        if (testPerk(index_header.perks, perk) && !perk_ids.test(perk)) {
+            return false;
+        }
+    }
+    std::bitset<std::numeric_limits<component_id_t>::max() + 1> component_ids;
+    component_ids.set(empty_component_id);
+    for (const Component &component : Component::all()) {
+        component_ids.set(component.id);
+    }
+    const auto *gizmo_records = section<GizmoRecord>(index_header.gizmos);
+    for (size_t i = 0; i < index_header.gizmos.count; ++i) {
+        for (size_t slot = 0; slot < gizmo_records[i].size(); ++slot) {
+            component_id_t id = gizmo_records[i][slot];
+            if (!component_ids.test(id) || (slot >= slotsForType(gizmoType()) && id != empty_component_id)) {
+                return false;
+            }
+        }
+    }
+
+    const auto *result_records = section<ResultRecord>(index_header.results);
+    for (size_t i = 0; i < index_header.results.count; ++i) {
+        const ResultRecord &record = result_records[i];
+        if ((i > 0 && record.key <= result_records[i - 1].key) ||
+            !indexed(static_cast<perk_id_t>(record.key >> 24)) || !indexed(static_cast<perk_id_t>(record.key >> 8)) ||
+            record.offset > index_header.entries.count || record.count > index_header.entries.count - record.offset) {
+            return false;
+        }
+    }
+    const auto *entry_records = section<EntryRecord>(index_header.entries);
+    for (size_t i = 0; i < index_header.entries.count; ++i) {
+        const EntryRecord &entry = entry_records[i];
+        if (entry.gizmo >= index_header.gizmos.count || !std::isfinite(entry.probability) ||
+            entry.probability < 0 || entry.probability > 1) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::unique_ptr<GizmoIndex> GizmoIndex::open(const std::string &filename) {
+    std::unique_ptr<MappedFile> file = MappedFile::open(filename);
+    if (!file) {
+        return nullptr;
+    }
+    std::unique_ptr<GizmoIndex> index(new GizmoIndex(std::move(file)));
+    if (!index->valid()) {
+        return nullptr;
+    }
+    return index;
+}
+
+bool GizmoIndex::build(const std::string &filename,
+                       EquipmentType equipment_type,
+                       GizmoType gizmo_type,
+                       level_t invention_level,
+                       const std::vector<Perk> &perks,
+                       uint64_t data_hash,
+                       int thread_count) {
+    thread_count = std::max(thread_count, 1);
+    std::array<uint64_t, 4> perk_bits{};
+    for (const Perk &perk : perks) {
+        perk_bits[perk.id / 64] |= uint64_t(1) << (perk.id % 64);
+    }
+
+    // Gizmos only need to be listed once for all the targets they can roll, so take the union of the candidates of
+    // every target over the perks. Candidates for a higher rank are a subset of those for rank one, so one search per
+    // pair of perks covers every rank. The set keeps them in a fixed order, so the same data gives the same index.
+    std::set<GizmoRecord> unique_gizmos;
+    auto addCandidates = [&](const GizmoResult &target) {
+        OptimalGizmoSearch search(equipment_type, gizmo_type, target);
+        search.build_candidate_list({}, thread_count, invention_level);
+        for (const Gizmo &candidate : search.candidates()) {
+            unique_gizmos.insert(gizmoRecord(candidate));
+        }
+    };
+    for (size_t i = 0; i < perks.size(); ++i) {
+        addCandidates({{perks[i], 1}, {Perk::no_effect, 0}});
+        for (size_t j = i + 1; j < perks.size(); ++j) {
+            addCandidates({{perks[i], 1}, {perks[j], 1}});
+        }
+    }
+    std::vector<GizmoRecord> gizmo_records(unique_gizmos.begin(), unique_gizmos.end());
+    unique_gizmos.clear();
+    if (gizmo_records.size() > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+
+    // Work out every gizmo's full distribution, keeping the results which only roll indexed perks. Each thread lists
+    // entries by result on its own, and the lists are joined up afterwards.
+    std::vector<std::unordered_map<uint32_t, std::vector<EntryRecord>>> thread_entries(thread_count);
+    std::atomic<size_t> next_gizmo(0);
+    auto evaluate = [&](std::unordered_map<uint32_t, std::vector<EntryRecord>> &entries) {
+        for (size_t i = next_gizmo++; i < gizmo_records.size(); i = next_gizmo++) {
+            Gizmo gizmo = recordGizmo(equipment_type, gizmo_type, gizmo_records[i]);
+            for (const GizmoResultProbability &result : gizmo.perkProbabilities(invention_level)) {
+                bool result_indexed = (result.result.first.perk.id == no_effect_id ||
+                                       testPerk(perk_bits, result.result.first.perk.id)) &&
+                                      (result.result.second.perk.id == no_effect_id ||
+                                       testPerk(perk_bits, result.result.second.perk.id));
+                if (result_indexed && result.probability > 0) {
+                    entries[result.result.key()].push_back({result.probability, static_cast<uint32_t>(i), 0});
+                }
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i) {
+        threads.emplace_back(evaluate, std::ref(thread_entries[i]));
+    }
+    evaluate(thread_entries[0]);
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    std::map<uint32_t, std::vector<EntryRecord>> result_entries;
+    for (std::unordered_map<uint32_t, std::vector<EntryRecord>> &entries : thread_entries) {
+        for (auto &[key, key_entries] : entries) {
+            std::vector<EntryRecord> &joined = result_entries[key];
+            joined.insert(joined.end(), key_entries.begin(), key_entries.end());
+        }
+        entries.clear();
+    }
+
+    std::vector<ResultRecord> result_records;
+    std::vector<EntryRecord> entry_records;
+    for (auto &[key, entries] : result_entries) {
+        std::sort(entries.begin(), entries.end(), betterEntry);
+        result_records.push_back({key, static_cast<uint32_t>(entries.size()), entry_records.size()});
+        entry_records.insert(entry_records.end(), entries.begin(), entries.end());
+    }
+
+    MappedFileBuilder builder(sizeof(Header));
+    Header index_header{};
+    index_header.format = index_format;
+    index_header.equipment_type = equipment_type;
+    index_header.gizmo_type = gizmo_type;
+    index_header.invention_level = invention_level;
+    index_header.data_hash = data_hash;
+    index_header.perks = perk_bits;
+    index_header.gizmos = builder.add(gizmo_records.data(), sizeof(GizmoRecord), gizmo_records.size());
+    index_header.results = builder.add(result_records.data(), sizeof(ResultRecord), result_records.size());
+    index_header.entries = builder.add(entry_records.data(), sizeof(EntryRecord), entry_records.size());
+    index_header.size = builder.size();
+
+    return MappedFile::replace(filename, builder.contents(&index_header));
+}
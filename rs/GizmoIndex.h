@@ -0,0 +1,108 @@
+#ifndef RSPERKS_GIZMOINDEX_H
+#define RSPERKS_GIZMOINDEX_H
+
+
+#include "InventionTypes.h"
+#include "Component.h"
+#include "Perk.h"
+#include "Gizmo.h"
+#include "MappedFile.h"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/**
+ * Precomputed reverse index from gizmo results to the gizmos which can roll them, so that searching for a target
+ * becomes a lookup.
+ *
+ * An index is built offline for one equipment type, gizmo type and invention level over a set of perks. Every normal
+ * form gizmo which a search for any pair of those perks (or any one of them alone) would consider is enumerated once,
+ * its full perkProbabilities worked out, and the gizmo listed against each result it can roll. Each result's list is
+ * sorted by probability, best first. Like the data image, the file is a flat run of fixed size records used in place
+ * from a mapping, only valid for builds with the same record layouts and byte order.
+ */
+class GizmoIndex {
+public:
+    typedef std::array<component_id_t, 9> GizmoRecord;
+
+    struct ResultRecord {
+        // GizmoResult::key, which the records are sorted by.
+        uint32_t key;
+        uint32_t count;
+        uint64_t offset;
+    };
+
+    struct EntryRecord {
+        probability_t probability;
+        uint32_t gizmo;
+        uint32_t padding;
+    };
+
+    template<typename T>
+    using Records = MappedRecords<T>;
+
+    [[nodiscard]] EquipmentType equipmentType() const;
+
+    [[nodiscard]] GizmoType gizmoType() const;
+
+    [[nodiscard]] level_t inventionLevel() const;
+
+    // Hash of the data files the index was built from, as given to build.
+    [[nodiscard]] uint64_t dataHash() const;
+
+    [[nodiscard]] std::vector<Perk> perks() const;
+
+    // Whether both perks of a target were indexed, in which case results lists every gizmo a search could find.
+    [[nodiscard]] bool covers(const GizmoResult &target) const;
+
+    // Gizmos which roll exactly the target, best first. Empty if no indexed gizmo can.
+    [[nodiscard]] Records<EntryRecord> results(const GizmoResult &target) const;
+
+    [[nodiscard]] Gizmo gizmo(const EntryRecord &entry) const;
+
+    [[nodiscard]] size_t gizmoCount() const;
+
+    [[nodiscard]] size_t resultCount() const;
+
+    [[nodiscard]] size_t entryCount() const;
+
+    // Maps and checks an index. Returns nullptr if it is missing, was built for a different format or layout, or
+    // refers to perks or components which are not registered.
+    [[nodiscard]] static std::unique_ptr<GizmoIndex> open(const std::string &filename);
+
+    // Builds an index over the given perks from the registered data, and writes it out. data_hash identifies the data
+    // files. Candidate generation and evaluation are both split over thread_count threads.
+    static bool build(const std::string &filename,
+                      EquipmentType equipment_type,
+                      GizmoType gizmo_type,
+                      level_t invention_level,
+                      const std::vector<Perk> &perks,
+                      uint64_t data_hash,
+                      int thread_count = 1);
+
+private:
+    typedef MappedSection Section;
+
+    struct Header;
+
+    std::unique_ptr<MappedFile> file_;
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+
+    explicit GizmoIndex(std::unique_ptr<MappedFile> file);
+
+    [[nodiscard]] const Header &header() const;
+
+    template<typename T>
+    [[nodiscard]] const T *section(const Section &section) const;
+
+    [[nodiscard]] bool indexed(perk_id_t perk) const;
+
+    [[nodiscard]] bool valid() const;
+};
+
+
+#endif //RSPERKS_GIZMOINDEX_H
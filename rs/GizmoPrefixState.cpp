@@ -0,0 +1,150 @@
+#include "GizmoPrefixState.h"
+#include <cassert>
+
+
+GizmoPrefixState::GizmoPrefixState(EquipmentType equipment_type, GizmoType gizmo_type) :
+        equipment_type_(equipment_type),
+        gizmo_type_(gizmo_type),
+        depth_(0),
+        perk_positions_(),
+        max_pdf_size_(0),
+        max_cdf_size_(0) {
+    components_.fill(Component::empty);
+    insertion_order_.reserve(PerkRankTable::max_perks);
+
+    // Size every buffer for the largest distribution any gizmo of this type can produce, so they never need to grow.
+    int max_base = 0;
+    int max_roll = 0;
+    for (const Component &component : Component::all()) {
+        for (const PerkContribution &contrib : component.perkContributions(equipment_type)) {
+            max_base = std::max<int>(max_base, contrib.base);
+            max_roll = std::max<int>(max_roll, contrib.roll);
+        }
+    }
+    size_t slots = slotsForType(gizmo_type);
+    max_pdf_size_ = slots * max_roll;
+    max_cdf_size_ = slots * max_base + max_pdf_size_;
+    for (PrefixLevel &level : levels_) {
+        level.entries.reserve(PerkRankTable::max_perks);
+    }
+    cdfs_.reserve(PerkRankTable::max_perks);
+    spare_cdfs_.reserve(PerkRankTable::max_perks);
+    cdf_pointers_.reserve(PerkRankTable::max_perks);
+}
+
+EquipmentType GizmoPrefixState::equipmentType() const {
+    return this->equipment_type_;
+}
+
+GizmoType GizmoPrefixState::type() const {
+    return this->gizmo_type_;
+}
+
+size_t GizmoPrefixState::depth() const {
+    return this->depth_;
+}
+
+void GizmoPrefixState::push(const Component &component) {
+    assert(depth_ < slotsForType(gizmo_type_));
+
+    // Entries are never removed from a level and distributions are copied in place, so once every buffer has grown to
+    // the largest size it needs, pushes no longer allocate.
+    PrefixLevel &level = levels_[depth_ + 1];
+    const PrefixLevel &previous = levels_[depth_];
+    while (level.entries.size() < previous.size) {
+        level.entries.emplace_back().rolls.reserve(max_pdf_size_);
+    }
+    for (size_t i = 0; i < previous.size; ++i) {
+        level.entries[i] = previous.entries[i];
+    }
+    level.size = previous.size;
+
+    auto &component_perks = component.perkContributions(this->equipment_type_);
+    for (const PerkContribution &contrib : component_perks) {
+        size_t position = perk_positions_[contrib.perk.id];
+        if (position >= level.size || level.entries[position].perk != contrib.perk.id) {
+            // Perk not seen before in this prefix, add it to the insertion order.
+            position = level.size++;
+            perk_positions_[contrib.perk.id] = position;
+            if (level.entries.size() < level.size) {
+                level.entries.emplace_back().rolls.reserve(max_pdf_size_);
+            }
+            level.entries[position].perk = contrib.perk.id;
+            level.entries[position].base = 0;
+            level.entries[position].rolls.clear();
+            insertion_order_.push_back(Perk::get(contrib.perk.id));
+        }
+
+        // Scaling must match Gizmo::perkRollCdf exactly, including the truncation to int.
+        PerkRollEntry &entry = level.entries[position];
+        entry.base += (this->gizmo_type_ == ANCIENT && !component.ancient()) ? 0.8 * contrib.base : contrib.base;
+        int roll = (this->gizmo_type_ == ANCIENT && !component.ancient()) ? 0.8 * contrib.roll : contrib.roll;
+
+        entry.rolls.add(roll);
+    }
+
+    components_[depth_] = component;
+    depth_++;
+}
+
+void GizmoPrefixState::pop() {
+    assert(depth_ > 0);
+    depth_--;
+    components_[depth_] = Component::empty;
+    insertion_order_.resize(levels_[depth_].size, Perk::no_effect);
+}
+
+size_t GizmoPrefixState::assign(const Gizmo &gizmo) {
+    assert(gizmo.equipmentType() == equipment_type_ && gizmo.type() == gizmo_type_);
+
+    // Find the length of the prefix shared with the current state.
+    size_t shared = 0;
+    auto gizmo_it = gizmo.begin();
+    while (shared < depth_ && gizmo_it != gizmo.end() && *gizmo_it == components_[shared]) {
+        shared++;
+        gizmo_it++;
+    }
+
+    while (depth_ > shared) {
+        pop();
+    }
+
+    size_t pushed = 0;
+    for (; gizmo_it != gizmo.end(); ++gizmo_it, ++pushed) {
+        push(*gizmo_it);
+    }
+
+    return pushed;
+}
+
+const std::vector<Perk> &GizmoPrefixState::insertionOrder() const {
+    return this->insertion_order_;
+}
+
+const std::vector<const CDF *> &GizmoPrefixState::perkRollCdf() const {
+    const PrefixLevel &level = levels_[depth_];
+    // Park unused CDFs rather than destroying them, so their capacity is kept.
+    while (cdfs_.size() > level.size) {
+        spare_cdfs_.push_back(std::move(cdfs_.back()));
+        cdfs_.pop_back();
+    }
+    while (cdfs_.size() < level.size) {
+        if (spare_cdfs_.empty()) {
+            cdfs_.emplace_back().reserve(max_cdf_size_);
+        } else {
+            cdfs_.push_back(std::move(spare_cdfs_.back()));
+            spare_cdfs_.pop_back();
+        }
+    }
+
+    cdf_pointers_.clear();
+    for (size_t i = 0; i < level.size; ++i) {
+        const PerkRollEntry &entry = level.entries[i];
+        CDF &cdf = cdfs_[i];
+        cdf.assign(entry.base, 0);
+        entry.rolls.appendCdf(cdf);
+        cdf_pointers_.push_back(&cdf);
+    }
+
+    return cdf_pointers_;
+}
@@ -0,0 +1,82 @@
+#ifndef RSPERKS_GIZMOPREFIXSTATE_H
+#define RSPERKS_GIZMOPREFIXSTATE_H
+
+
+#include "InventionTypes.h"
+#include "Component.h"
+#include "Perk.h"
+#include "Probability.h"
+#include "Gizmo.h"
+#include <array>
+#include <vector>
+
+
+/**
+ * Incrementally built perk state for a prefix of a gizmo's components.
+ *
+ * Holds one level per filled slot, each storing the perk insertion order so far along with the summed bases and
+ * summed roll distributions for every perk in it. Candidates are enumerated in odometer order, so consecutive gizmos
+ * usually share all but their last few components - assigning the next gizmo only rewinds to the shared prefix
+ * and pushes the remaining slots, instead of rebuilding every perk distribution from scratch.
+ */
+class GizmoPrefixState {
+public:
+    GizmoPrefixState(EquipmentType equipment_type, GizmoType gizmo_type);
+
+    [[nodiscard]] EquipmentType equipmentType() const;
+
+    [[nodiscard]] GizmoType type() const;
+
+    [[nodiscard]] size_t depth() const;
+
+    // Add a component in the next slot.
+    void push(const Component &component);
+
+    // Remove the component in the last filled slot.
+    void pop();
+
+    // Rewind to the prefix shared with the gizmo, then push its remaining components.
+    // Returns the number of slots which had to be pushed.
+    size_t assign(const Gizmo &gizmo);
+
+    [[nodiscard]] const std::vector<Perk> &insertionOrder() const;
+
+    // Contribution CDF for each perk, in insertion order. Matches Gizmo::perkRollCdf for the same components. The CDFs
+    // are rebuilt from the prefix's roll distributions on every call, and stay valid until the next one.
+    [[nodiscard]] const std::vector<const CDF *> &perkRollCdf() const;
+
+private:
+    struct PerkRollEntry {
+        perk_id_t perk;
+        int base;
+        UniformSumDistribution rolls;
+    };
+
+    struct PrefixLevel {
+        // Number of entries in use. Entries past this are kept for their buffers.
+        size_t size = 0;
+        std::vector<PerkRollEntry> entries;
+    };
+
+    EquipmentType equipment_type_;
+    GizmoType gizmo_type_;
+    size_t depth_;
+    std::array<Component, 9> components_;
+
+    // levels_[d] is the state after the first d components have been pushed.
+    std::array<PrefixLevel, 10> levels_;
+    std::vector<Perk> insertion_order_;
+    // Position of each perk in the insertion order, only valid for perks in the current level.
+    std::array<uint8_t, std::numeric_limits<perk_id_t>::max() + 1> perk_positions_;
+
+    // Upper bounds on the size of any perk's distributions, used to size buffers up front.
+    size_t max_pdf_size_;
+    size_t max_cdf_size_;
+
+    mutable std::vector<CDF> cdfs_;
+    mutable std::vector<CDF> spare_cdfs_;
+    mutable std::vector<const CDF *> cdf_pointers_;
+};
+
+
+#endif //RSPERKS_GIZMOPREFIXSTATE_H
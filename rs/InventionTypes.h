@@ -9,6 +9,8 @@
 #include <cstddef>
 #include <cstdint>
 #include <iostream>
+#include <limits>
+#include <string>
 
 enum EquipmentType {
     WEAPON = 0,
@@ -0,0 +1,113 @@
+#include "MappedFile.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RSPERKS_MAPPED_FILE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+bool MappedSection::fits(size_t file_size, size_t record_size) const {
+    return offset % MappedFileBuilder::section_alignment == 0 && offset <= file_size &&
+           count <= (file_size - offset) / record_size;
+}
+
+MappedFileBuilder::MappedFileBuilder(size_t header_size) : header_size_(header_size), contents_(header_size, '\0') {
+
+}
+
+MappedSection MappedFileBuilder::add(const void *data, size_t record_size, size_t count) {
+    contents_.resize((contents_.size() + section_alignment - 1) / section_alignment * section_alignment, '\0');
+    MappedSection section = {contents_.size(), count};
+    contents_.append(static_cast<const char *>(data), record_size * count);
+    return section;
+}
+
+size_t MappedFileBuilder::size() const {
+    return contents_.size();
+}
+
+const std::string &MappedFileBuilder::contents(const void *header) {
+    std::memcpy(contents_.data(), header, header_size_);
+    return contents_;
+}
+
+MappedFile::~MappedFile() {
+#ifdef RSPERKS_MAPPED_FILE_MMAP
+    if (data_ && !buffer_) {
+        munmap(const_cast<char *>(data_), size_);
+    }
+#endif
+}
+
+std::unique_ptr<MappedFile> MappedFile::open(const std::string &filename) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+
+#ifdef RSPERKS_MAPPED_FILE_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat file_status{};
+    if (fstat(fd, &file_status) != 0 || file_status.st_size <= 0) {
+        close(fd);
+        return nullptr;
+    }
+    void *mapped = mmap(nullptr, file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return nullptr;
+    }
+    file->data_ = static_cast<const char *>(mapped);
+    file->size_ = file_status.st_size;
+#else
+    std::ifstream stream(filename, std::ios::binary | std::ios::ate);
+    if (!stream) {
+        return nullptr;
+    }
+    auto size = static_cast<size_t>(stream.tellg());
+    if (size == 0) {
+        return nullptr;
+    }
+    // Read into 64-bit words, so the records are as aligned as they would be in a mapping.
+    file->buffer_.reset(new uint64_t[(size + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+    stream.seekg(0);
+    if (!stream.read(reinterpret_cast<char *>(file->buffer_.get()), static_cast<std::streamsize>(size))) {
+        return nullptr;
+    }
+    file->data_ = reinterpret_cast<const char *>(file->buffer_.get());
+    file->size_ = size;
+#endif
+
+    return file;
+}
+
+bool MappedFile::replace(const std::string &filename, const std::string &contents) {
+    // Write to a name no other writer will use, then rename it over the real file.
+    std::stringstream temp_path;
+    temp_path << filename << ".tmp." << std::hex << std::random_device()() << std::random_device()();
+    {
+        std::ofstream file(temp_path.str(), std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+        if (!file.flush()) {
+            file.close();
+            std::error_code error;
+            std::filesystem::remove(temp_path.str(), error);
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp_path.str(), filename, error);
+    if (error) {
+        std::filesystem::remove(temp_path.str(), error);
+        return false;
+    }
+    return true;
+}
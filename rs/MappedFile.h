@@ -0,0 +1,121 @@
+#ifndef RSPERKS_MAPPEDFILE_H
+#define RSPERKS_MAPPEDFILE_H
+
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+
+
+// A run of fixed size records within a mapped file.
+template<typename T>
+class MappedRecords {
+public:
+    MappedRecords(const T *begin, size_t size) : begin_(begin), size_(size) {}
+
+    [[nodiscard]] const T *begin() const { return begin_; }
+
+    [[nodiscard]] const T *end() const { return begin_ + size_; }
+
+    [[nodiscard]] size_t size() const { return size_; }
+
+    [[nodiscard]] bool empty() const { return size_ == 0; }
+
+    const T &operator[](size_t i) const { return begin_[i]; }
+
+private:
+    const T *begin_;
+    size_t size_;
+};
+
+
+// Where a run of records lies in a record file, as its header stores it.
+struct MappedSection {
+    uint64_t offset;
+    uint64_t count;
+
+    // Whether the records lie within a file of the given size, aligned as MappedFileBuilder places them.
+    [[nodiscard]] bool fits(size_t file_size, size_t record_size) const;
+};
+
+
+/**
+ * The fields every record file header starts with: the file's magic, the format version, and the byte order and record
+ * sizes of the build which wrote it. Files are only used by builds which match all of them.
+ */
+template<size_t RecordTypes>
+struct MappedFormat {
+    static constexpr uint32_t byte_order_mark = 0x01020304;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    std::array<uint32_t, RecordTypes> record_sizes;
+
+    bool operator==(const MappedFormat &other) const {
+        return std::memcmp(magic, other.magic, sizeof(magic)) == 0 && version == other.version &&
+               byte_order == other.byte_order && record_sizes == other.record_sizes;
+    }
+};
+
+
+// Lays out a record file: room for the header, then each section in turn, starting on a boundary suitable for any
+// record.
+class MappedFileBuilder {
+public:
+    static constexpr size_t section_alignment = 16;
+
+    explicit MappedFileBuilder(size_t header_size);
+
+    MappedSection add(const void *data, size_t record_size, size_t count);
+
+    // Size of the file so far.
+    [[nodiscard]] size_t size() const;
+
+    // The file's contents, with the header filled in.
+    const std::string &contents(const void *header);
+
+private:
+    size_t header_size_;
+    std::string contents_;
+};
+
+
+/**
+ * Read only view of a whole file, for the binary files the tools use in place.
+ *
+ * Files are memory mapped where the platform supports it, so only the pages used are ever read, and otherwise read
+ * into a buffer aligned for any record. Either way the contents stay put for the lifetime of the object.
+ */
+class MappedFile {
+public:
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    [[nodiscard]] const char *data() const { return data_; }
+
+    [[nodiscard]] size_t size() const { return size_; }
+
+    // Returns nullptr if the file is missing, empty or cannot be read.
+    [[nodiscard]] static std::unique_ptr<MappedFile> open(const std::string &filename);
+
+    // Replaces a file with new contents in one step: truncating a file another process has mapped would crash it.
+    static bool replace(const std::string &filename, const std::string &contents);
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+    // Set when the file was read rather than mapped.
+    std::unique_ptr<uint64_t[]> buffer_;
+
+    MappedFile() = default;
+};
+
+
+#endif //RSPERKS_MAPPEDFILE_H
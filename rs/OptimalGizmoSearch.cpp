@@ -3,8 +3,15 @@
 //
 
 #include "OptimalGizmoSearch.h"
+#include "GizmoPrefixState.h"
+#include "DistributionCache.h"
+#include "AllocationCounter.h"
+#include "BoundedQueue.h"
+#include <array>
 #include <bitset>
+#include <chrono>
 #include <iomanip>
+#include <memory>
 #include <thread>
 
 
@@ -16,21 +23,131 @@ std::ostream &operator<<(std::ostream &strm, const GizmoTargetProbability &resul
                 << static_cast<size_t>(static_cast<float>(result.gizmo->cost()) / result.target_probability);
 }
 
-OptimalGizmoSearch::OptimalGizmoSearch(EquipmentType equipment, GizmoType gizmo_type, GizmoResult target) :
+std::ostream &operator<<(std::ostream &strm, const SearchObjective &objective) {
+    switch (objective) {
+        case MAX_PROBABILITY:
+            return strm << "Probability";
+        case MIN_EXPECTED_COST:
+            return strm << "Expected Cost";
+        default:
+            return strm << "INVALID";
+    }
+}
+
+GizmoTargetProbability::GizmoTargetProbability(const Gizmo *g, probability_t p) :
+        gizmo(g),
+        target_probability(p),
+        empty_slots(std::count(g->begin(), g->end(), Component::empty)),
+        cost(g->cost()) {
+
+}
+
+probability_t GizmoTargetProbability::score(SearchObjective objective) const {
+    return objectiveScore(objective, target_probability, cost);
+}
+
+probability_t objectiveScore(SearchObjective objective, probability_t probability, size_t cost) {
+    switch (objective) {
+        case MIN_EXPECTED_COST:
+            return cost > 0 ? probability / static_cast<probability_t>(cost)
+                            : (probability > 0 ? std::numeric_limits<probability_t>::infinity() : 0);
+        case MAX_PROBABILITY:
+        default:
+            return probability;
+    }
+}
+
+bool betterResult(const GizmoTargetProbability &a, const GizmoTargetProbability &b, SearchObjective objective) {
+    probability_t a_score = a.score(objective);
+    probability_t b_score = b.score(objective);
+    if (a_score == b_score) {
+        return a.empty_slots > b.empty_slots;
+    }
+    return a_score > b_score;
+}
+
+TopResults::TopResults(size_t limit, SearchObjective objective) : limit_(limit), objective_(objective) {
+    if (limit_ > 0) {
+        results_.reserve(limit_);
+    }
+}
+
+bool TopResults::accepts(const GizmoTargetProbability &result) const {
+    return limit_ == 0 || results_.size() < limit_ || betterResult(result, results_.front(), objective_);
+}
+
+void TopResults::offer(const GizmoTargetProbability &result) {
+    if (limit_ == 0) {
+        results_.push_back(result);
+        return;
+    }
+
+    auto order = [this](const GizmoTargetProbability &a, const GizmoTargetProbability &b) {
+        return betterResult(a, b, objective_);
+    };
+    if (results_.size() < limit_) {
+        results_.push_back(result);
+        std::push_heap(results_.begin(), results_.end(), order);
+    } else if (order(result, results_.front())) {
+        std::pop_heap(results_.begin(), results_.end(), order);
+        results_.back() = result;
+        std::push_heap(results_.begin(), results_.end(), order);
+    }
+}
+
+probability_t TopResults::threshold() const {
+    if (limit_ == 0 || results_.size() < limit_) {
+        return 0;
+    }
+    return results_.front().score(objective_);
+}
+
+std::vector<GizmoTargetProbability> TopResults::merge(std::vector<TopResults> &parts, size_t limit,
+                                                      SearchObjective objective) {
+    std::vector<GizmoTargetProbability> merged;
+    merged.reserve(std::accumulate(parts.begin(), parts.end(), size_t(0), [](size_t total, const TopResults &part) {
+        return total + part.results_.size();
+    }));
+    for (TopResults &part : parts) {
+        merged.insert(merged.end(), part.results_.begin(), part.results_.end());
+        part.results_.clear();
+    }
+
+    auto order = [objective](const GizmoTargetProbability &a, const GizmoTargetProbability &b) {
+        return betterResult(a, b, objective);
+    };
+    if (limit > 0 && merged.size() > limit) {
+        std::partial_sort(merged.begin(), merged.begin() + limit, merged.end(), order);
+        merged.erase(merged.begin() + limit, merged.end());
+    } else {
+        std::sort(merged.begin(), merged.end(), order);
+    }
+    return merged;
+}
+
+OptimalGizmoSearch::OptimalGizmoSearch(EquipmentType equipment, GizmoType gizmo_type, GizmoResult target,
+                                       SearchObjective objective) :
+        total_candidates(0),
         equipment_type_(equipment),
         gizmo_type_(gizmo_type),
-        target_(target) {
+        target_(target),
+        objective_(objective),
+        search_complete_(false) {
 
 }
 
-size_t OptimalGizmoSearch::build_candidate_list(const std::vector<Component> &excluded) {
-    candidate_gizmos_ = candidateGizmos(excluded);
+size_t OptimalGizmoSearch::build_candidate_list(const std::vector<Component> &excluded, int thread_count,
+                                                level_t max_level) {
+    search_complete_ = false;
+    candidate_gizmos_ = thread_count > 1 ? parallelCandidateGizmos(excluded, thread_count, max_level)
+                                         : candidateGizmos(excluded, max_level);
     total_candidates = candidate_gizmos_.size();
     return total_candidates;
 }
 
-std::vector<GizmoTargetProbability> OptimalGizmoSearch::results(level_t invention_level, int thread_count) {
-    return targetSearchResults(invention_level, thread_count);
+std::vector<GizmoTargetProbability> OptimalGizmoSearch::results(level_t invention_level, int thread_count,
+                                                                size_t grain_size, size_t max_results) {
+    return targetSearchResults(invention_level, thread_count, grain_size, max_results);
 }
 
 size_t OptimalGizmoSearch::resultsSearched() {
@@ -40,7 +157,24 @@ size_t OptimalGizmoSearch::resultsSearched() {
                            });
 }
 
-std::vector<Component> OptimalGizmoSearch::targetPossibleComponents(const std::vector<Component> &excluded) const {
+const std::vector<Gizmo> &OptimalGizmoSearch::candidates() const {
+    return candidate_gizmos_;
+}
+
+const std::vector<SubsearchProgress> &OptimalGizmoSearch::threadProgress() const {
+    return thread_progress_;
+}
+
+bool OptimalGizmoSearch::searchComplete() const {
+    return search_complete_;
+}
+
+void OptimalGizmoSearch::useDistributionCache(DistributionCache *cache) {
+    distribution_cache_ = cache;
+}
+
+std::vector<Component> OptimalGizmoSearch::targetPossibleComponents(const std::vector<Component> &excluded,
+                                                                    level_t max_level) const {
     std::vector<Component> possible_components;
     std::copy_if(Component::all().begin(), Component::all().end(), std::back_inserter(possible_components),
                  [&](Component c) {
@@ -51,7 +185,10 @@ std::vector<Component> OptimalGizmoSearch::targetPossibleComponents(const std::v
                      if (gizmo_type_ != ANCIENT && c.ancient()) {
                          return false;
                      }
-                     auto component_perks = c.perkContributions(equipment_type_);
+                     if (c.requiredLevel() > max_level) {
+                         return false;
+                     }
+                     const auto &component_perks = c.perkContributions(equipment_type_);
                      return std::any_of(component_perks.begin(), component_perks.end(),
                                         [&](const PerkContribution &contrib) {
                                             return contrib.perk == target_.first.perk ||
@@ -62,185 +199,572 @@ std::vector<Component> OptimalGizmoSearch::targetPossibleComponents(const std::v
     return possible_components;
 }
 
-std::vector<Gizmo> OptimalGizmoSearch::candidateGizmos(const std::vector<Component> &excluded) const {
-    std::vector<Component> possible_components = targetPossibleComponents(excluded);
-    if (possible_components.size() == 0) {
-        return {};
+std::vector<Gizmo> OptimalGizmoSearch::candidateGizmos(const std::vector<Component> &excluded,
+                                                       level_t max_level) const {
+    std::vector<Gizmo> candidates;
+    candidates.reserve(32000);
+    enumerateCandidates(excluded, max_level, [&](const std::vector<Component> &configuration) {
+        candidates.emplace_back(equipment_type_, gizmo_type_, configuration);
+    });
+    return candidates;
+}
+
+std::vector<Gizmo> OptimalGizmoSearch::parallelCandidateGizmos(const std::vector<Component> &excluded,
+                                                                int thread_count,
+                                                                level_t max_level) const {
+    std::vector<Component> possible_components = targetPossibleComponents(excluded, max_level);
+    size_t prefix_count = possible_components.size() * possible_components.size();
+
+    // Each partition covers the candidates starting with one pair of leading components. Partitions are claimed
+    // in order from a shared cursor, and their outputs kept separate so they can be joined back up in the same
+    // order the serial enumeration would have produced them.
+    std::vector<std::vector<Gizmo>> partitions(prefix_count);
+    std::atomic<size_t> next_prefix(0);
+
+    auto generate = [&]() {
+        for (size_t prefix = next_prefix++; prefix < prefix_count; prefix = next_prefix++) {
+            std::vector<Gizmo> &partition = partitions[prefix];
+            enumerateCandidates(possible_components, prefix, prefix + 1,
+                                [&](const std::vector<Component> &configuration) {
+                                    partition.emplace_back(equipment_type_, gizmo_type_, configuration);
+                                });
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < thread_count; ++i) {
+        threads.emplace_back(generate);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
     }
 
     std::vector<Gizmo> candidates;
-    candidates.reserve(32000);
+    candidates.reserve(std::accumulate(partitions.begin(), partitions.end(), size_t(0),
+                                       [](size_t total, const std::vector<Gizmo> &partition) {
+                                           return total + partition.size();
+                                       }));
+    for (std::vector<Gizmo> &partition : partitions) {
+        std::move(partition.begin(), partition.end(), std::back_inserter(candidates));
+    }
+    return candidates;
+}
 
-    // Thresholds for target perks.
-    rank_threshold_t target_1_threshold = target_.first.perk.rank(target_.first.rank).threshold;
-    rank_threshold_t target_2_threshold = target_.second.perk.rank(target_.second.rank).threshold;
-
-    // Maximum possible gizmo contribution from a component.
-    size_t max_target_1_contrib = std::max_element(possible_components.begin(),
-                                                   possible_components.end(),
-                                                   [&](const Component &c1, const Component &c2) {
-                                                       return c1.totalPotentialContribution(equipment_type_,
-                                                                                            target_.first.perk.id) <
-                                                              c2.totalPotentialContribution(equipment_type_,
-                                                                                            target_.first.perk.id);
-                                                   })->totalPotentialContribution(equipment_type_,
-                                                                                  target_.first.perk.id);
-    size_t max_target_2_contrib = std::max_element(possible_components.begin(),
-                                                   possible_components.end(),
-                                                   [&](const Component &c1, const Component &c2) {
-                                                       return c1.totalPotentialContribution(equipment_type_,
-                                                                                            target_.second.perk.id) <
-                                                              c2.totalPotentialContribution(equipment_type_,
-                                                                                            target_.second.perk.id);
-                                                   })->totalPotentialContribution(equipment_type_,
-                                                                                  target_.second.perk.id);
-
-    // Vector to hold current configurations.
-    std::vector<Component> current_configuration(slotsForType(gizmo_type_), Component::empty);
-    // Loop through, adding candidate gizmos.
-    std::vector<size_t> indices(slotsForType(gizmo_type_), 0);
-    while (indices[0] < possible_components.size()) {
-        size_t t1_contrib_remaining = max_target_1_contrib * slotsForType(gizmo_type_);
-        size_t t2_contrib_remaining = max_target_2_contrib * slotsForType(gizmo_type_);
-
-        // Ensure only normal form gizmos are generated.
-        std::bitset<std::numeric_limits<perk_id_t>::max()>
-                possible_perks = possible_components[indices[0]].possiblePerkBitset(equipment_type_);
-        size_t current_t1_contrib = possible_components[indices[0]].totalPotentialContribution(equipment_type_,
-                                                                                               target_.first.perk.id);
-        size_t current_t2_contrib = possible_components[indices[0]].totalPotentialContribution(equipment_type_,
-                                                                                               target_.second.perk.id);
-
-        bool indifferent = false;
-
-        if (possible_components[indices[0]] == Component::empty) {
-            goto skip;
-        }
-
-        for (size_t i = 1; i < indices.size(); ++i) {
-            size_t idx = indices[i];
-            t1_contrib_remaining -= max_target_1_contrib;
-            t2_contrib_remaining -= max_target_2_contrib;
-
-            // Check if the current component adds new possible perks.
-            auto current_comp_possible_perks = possible_components[idx].possiblePerkBitset(equipment_type_);
-            bool contributes_new = (possible_perks & current_comp_possible_perks) != current_comp_possible_perks;
-
-            if (indifferent && contributes_new) {
-                // If this current component does not generate new perks, advance until we find one that does.
-                for (size_t reset_idx = i + 1; reset_idx < indices.size(); ++reset_idx) {
-                    indices[reset_idx] = possible_components.size() - 1;
-                }
-                goto skip;
+void OptimalGizmoSearch::enumerateCandidates(const std::vector<Component> &excluded,
+                                             level_t max_level,
+                                             const std::function<void(const std::vector<Component> &)> &emit) const {
+    std::vector<Component> possible_components = targetPossibleComponents(excluded, max_level);
+    enumerateCandidates(possible_components, 0, possible_components.size() * possible_components.size(), emit);
+}
+
+namespace {
+    // The perks a component can give, as plain 64-bit words, so the normal form checks are a handful of word
+    // operations rather than bitset copies.
+    struct PerkMask {
+        static constexpr size_t word_count = 4;
+        static_assert(std::numeric_limits<perk_id_t>::max() <= word_count * 64, "Every perk ID needs a bit");
+
+        std::array<uint64_t, word_count> words{};
+
+        static PerkMask of(const std::bitset<std::numeric_limits<perk_id_t>::max()> &perks) {
+            const std::bitset<std::numeric_limits<perk_id_t>::max()> low_word(~uint64_t(0));
+            PerkMask mask;
+            for (size_t i = 0; i < word_count; ++i) {
+                mask.words[i] = ((perks >> (64 * i)) & low_word).to_ullong();
             }
+            return mask;
+        }
 
-            // If currently indifferent, check the ID's are in order (if not move on).
-            if (indifferent && possible_components[indices[i - 1]].id > possible_components[idx].id) {
-                for (size_t reset_idx = i + 1; reset_idx < indices.size(); ++reset_idx) {
-                    indices[reset_idx] = possible_components.size() - 1;
-                }
-                goto skip;
+        // True if every perk here is also in other.
+        [[nodiscard]] bool within(const PerkMask &other) const {
+            uint64_t outside = 0;
+            for (size_t i = 0; i < word_count; ++i) {
+                outside |= words[i] & ~other.words[i];
+            }
+            return outside == 0;
+        }
+
+        PerkMask operator|(const PerkMask &other) const {
+            PerkMask mask;
+            for (size_t i = 0; i < word_count; ++i) {
+                mask.words[i] = words[i] | other.words[i];
             }
+            return mask;
+        }
+    };
+
+    // Depth first generation of normal form candidates. Everything a slot is checked against is looked up once per
+    // component up front, and the perks possible so far are carried down the recursion, so each slot is checked in
+    // constant time and a failing prefix drops its whole subtree at once. Candidates come out in the same order as
+    // counting through the component indices would give.
+    class CandidateGenerator {
+    public:
+        typedef std::function<void(const std::vector<Component> &)> emit_t;
+
+        CandidateGenerator(const std::vector<Component> &possible_components,
+                           EquipmentType equipment_type,
+                           GizmoType gizmo_type,
+                           const GizmoResult &target,
+                           const std::atomic<probability_t> *cost_threshold,
+                           const emit_t &emit) :
+                slot_count_(slotsForType(gizmo_type)),
+                target_1_threshold_(target.first.perk.rank(target.first.rank).threshold),
+                target_2_threshold_(target.second.perk.rank(target.second.rank).threshold),
+                cost_threshold_(cost_threshold),
+                emit_(emit),
+                configuration_(slotsForType(gizmo_type), Component::empty) {
+            options_.reserve(possible_components.size());
+            for (const Component &component : possible_components) {
+                Option option = {component,
+                                 PerkMask::of(component.possiblePerkBitset(equipment_type)),
+                                 static_cast<size_t>(component.totalPotentialContribution(equipment_type,
+                                                                                          target.first.perk.id)),
+                                 static_cast<size_t>(component.totalPotentialContribution(equipment_type,
+                                                                                          target.second.perk.id)),
+                                 component.cost()};
+                max_target_1_contrib_ = std::max(max_target_1_contrib_, option.target_1_contrib);
+                max_target_2_contrib_ = std::max(max_target_2_contrib_, option.target_2_contrib);
+                options_.push_back(option);
+            }
+        }
 
-            current_t1_contrib += possible_components[idx].totalPotentialContribution(equipment_type_,
-                                                                                      target_.first.perk.id);
-            current_t2_contrib += possible_components[idx].totalPotentialContribution(equipment_type_,
-                                                                                      target_.second.perk.id);
-
-            // Check it'll be possible to generate the targets.
-            if (current_t1_contrib + t1_contrib_remaining < target_1_threshold ||
-                current_t2_contrib + t2_contrib_remaining < target_2_threshold) {
-                // Cannot possibly reach one of the targets from this point forwards.
-                for (size_t reset_idx = i + 1; reset_idx < indices.size(); ++reset_idx) {
-                    indices[reset_idx] = possible_components.size() - 1;
+        // Generates the candidates whose first two component indices (as index[0] * n + index[1]) fall within
+        // [prefix_begin, prefix_end).
+        void generate(size_t prefix_begin, size_t prefix_end) {
+            size_t n = options_.size();
+            for (size_t first = prefix_begin / n; first < n && first * n < prefix_end; ++first) {
+                const Option &option = options_[first];
+                // Gizmos are filled from the first slot, so one starting with nothing is not in normal form.
+                if (option.component == Component::empty || overBudget(option.cost, costThreshold())) {
+                    continue;
                 }
-                goto skip;
+
+                configuration_[0] = option.component;
+                size_t second_begin = first == prefix_begin / n ? prefix_begin % n : 0;
+                size_t second_end = std::min(n, prefix_end - first * n);
+                descend(1, second_begin, second_end, option.perks, false, option.target_1_contrib,
+                        option.target_2_contrib, option.cost);
             }
+        }
 
-            indifferent = !contributes_new;
-            possible_perks = possible_perks | current_comp_possible_perks;
+    private:
+        struct Option {
+            Component component;
+            PerkMask perks;
+            size_t target_1_contrib;
+            size_t target_2_contrib;
+            size_t cost;
+        };
+
+        size_t slot_count_;
+        rank_threshold_t target_1_threshold_;
+        rank_threshold_t target_2_threshold_;
+        size_t max_target_1_contrib_ = 0;
+        size_t max_target_2_contrib_ = 0;
+        const std::atomic<probability_t> *cost_threshold_;
+        const emit_t &emit_;
+        std::vector<Option> options_;
+        std::vector<Component> configuration_;
+
+        [[nodiscard]] probability_t costThreshold() const {
+            return cost_threshold_ ? cost_threshold_->load(std::memory_order_relaxed) : 0;
         }
 
-        // Add the current configuration to our candidate gizmo list.
-        std::transform(indices.begin(), indices.end(), current_configuration.begin(), [&](size_t idx) {
-            return possible_components[idx];
-        });
-        candidates.emplace_back(equipment_type_, gizmo_type_, current_configuration);
+        // A gizmo's expected cost is at least its own cost, so once a prefix costs more than the worst expected cost
+        // being kept, nothing starting with it can be kept.
+        static bool overBudget(size_t cost, probability_t cost_threshold) {
+            return cost_threshold > 0 && cost * cost_threshold > 1.0 + 1e-9;
+        }
+
+        // Fills slot onwards, taking this slot's component from [begin, end). indifferent is set when the previous
+        // slot added no new perks, after which every further component must add none either, in ID order.
+        void descend(size_t slot, size_t begin, size_t end, const PerkMask &possible_perks, bool indifferent,
+                     size_t target_1_contrib, size_t target_2_contrib, size_t cost) {
+            if (slot == slot_count_) {
+                emit_(configuration_);
+                return;
+            }
 
-        // Increment indices.
-        skip:
-        for (size_t i = indices.size() - 1; i < indices.size(); --i) {
-            indices[i]++;
-            if (indices[i] >= possible_components.size()) {
-                if (i == 0) {
-                    break;
+            size_t target_1_remaining = max_target_1_contrib_ * (slot_count_ - slot);
+            size_t target_2_remaining = max_target_2_contrib_ * (slot_count_ - slot);
+            probability_t cost_threshold = costThreshold();
+            for (size_t i = begin; i < end; ++i) {
+                const Option &option = options_[i];
+                bool contributes_new = !option.perks.within(possible_perks);
+                if (indifferent && (contributes_new || configuration_[slot - 1].id > option.component.id)) {
+                    continue;
                 }
 
-                indices[i] = 0;
-                continue;
-            }
+                // Check it'll still be possible to generate the targets.
+                size_t slot_target_1_contrib = target_1_contrib + option.target_1_contrib;
+                size_t slot_target_2_contrib = target_2_contrib + option.target_2_contrib;
+                if (slot_target_1_contrib + target_1_remaining < target_1_threshold_ ||
+                    slot_target_2_contrib + target_2_remaining < target_2_threshold_) {
+                    continue;
+                }
+
+                if (overBudget(cost + option.cost, cost_threshold)) {
+                    continue;
+                }
 
-            break;
+                configuration_[slot] = option.component;
+                descend(slot + 1, 0, options_.size(), possible_perks | option.perks, !contributes_new,
+                        slot_target_1_contrib, slot_target_2_contrib, cost + option.cost);
+            }
         }
+    };
+}
+
+void OptimalGizmoSearch::enumerateCandidates(const std::vector<Component> &possible_components,
+                                             size_t prefix_begin,
+                                             size_t prefix_end,
+                                             const std::function<void(const std::vector<Component> &)> &emit,
+                                             const std::atomic<probability_t> *score_threshold) const {
+    if (possible_components.size() == 0) {
+        return;
     }
 
-    return candidates;
+    bool cut_by_cost = objective_ == MIN_EXPECTED_COST && score_threshold != nullptr;
+    CandidateGenerator generator(possible_components, equipment_type_, gizmo_type_, target_,
+                                 cut_by_cost ? score_threshold : nullptr, emit);
+    generator.generate(prefix_begin, prefix_end);
+}
+
+// Raise a threshold shared between threads to at least the given value.
+void raiseThreshold(std::atomic<probability_t> *shared_threshold, probability_t threshold) {
+    probability_t current = shared_threshold->load(std::memory_order_relaxed);
+    while (current < threshold && !shared_threshold->compare_exchange_weak(current, threshold)) {}
+}
+
+// Evaluate a candidate, offering it to the results if it has a chance of being kept. keep is called to get the gizmo
+// pointer to store for a kept candidate.
+// Candidates whose upper bound falls below the K-th best score found by any thread so far are pruned without the full
+// evaluation.
+// With a distribution cache, the candidate's whole distribution is built in the thread's buffer for the cache, unless
+// another search has already built it, and both steps are evaluated from that. Without one, the bound is worked out
+// from the prefix state alone, as building the rest of the distribution costs more than it saves for a single search.
+// Everything up to offering the result works in the prefix state's buffers, the distribution buffer or on the stack,
+// so once those buffers have grown no heap allocations are made, other than adding to a distribution cache.
+template<typename F>
+void evaluateCandidate(const Gizmo &candidate, const CDF &budget_cdf, const GizmoResult &target,
+                       SearchObjective objective, GizmoPrefixState &prefix_state, GizmoDistribution *distribution,
+                       DistributionCache *distribution_cache, TopResults *results,
+                       std::atomic<probability_t> *shared_threshold, SubsearchProgress *progress, F keep) {
+    size_t allocations_before = threadHeapAllocations();
+    if (distribution_cache == nullptr) {
+        prefix_state.assign(candidate);
+    } else if (!distribution_cache->find(candidate, *distribution)) {
+        prefix_state.assign(candidate);
+        candidate.distribution(prefix_state, *distribution);
+        distribution_cache->insert(candidate, *distribution);
+    }
+    progress->results_searched++;
+
+    probability_t threshold = std::max(results->threshold(), shared_threshold->load(std::memory_order_relaxed));
+    probability_t upper_bound = distribution_cache == nullptr ?
+                                candidate.targetProbabilityUpperBound(budget_cdf, target, prefix_state) :
+                                candidate.targetProbabilityUpperBound(budget_cdf, target, *distribution);
+    if (upper_bound == 0 || objectiveScore(objective, upper_bound, candidate.cost()) < threshold) {
+        progress->candidates_pruned++;
+        progress->heap_allocations += threadHeapAllocations() - allocations_before;
+        return;
+    }
+
+    probability_t total_gizmo_probability = distribution_cache == nullptr ?
+                                            candidate.targetProbability(budget_cdf, target, prefix_state) :
+                                            candidate.targetProbability(budget_cdf, target, *distribution);
+    progress->heap_allocations += threadHeapAllocations() - allocations_before;
+    if (total_gizmo_probability > 0 && results->accepts({&candidate, total_gizmo_probability})) {
+        results->offer({keep(candidate), total_gizmo_probability});
+        raiseThreshold(shared_threshold, results->threshold());
+    }
 }
 
-void targetSubsearchResults(level_t invention_level, GizmoResult *target__, int64_t *results_searched,
-                            std::vector<GizmoTargetProbability> *results, std::vector<Gizmo> *candidates, int stride,
-                            int offset) {
-    for (size_t i = offset; i < candidates->size(); i += stride) {
-        const Gizmo &candidate = (*candidates)[i];
-        auto possible_results = candidate.targetPerkProbabilities(invention_level, *target__);
-        probability_t total_gizmo_probability = std::accumulate(possible_results.begin(),
-                                                                possible_results.end(),
-                                                                0.0,
-                                                                [](probability_t x,
-                                                                   const GizmoResultProbability &result) {
-                                                                    return x + result.probability;
-                                                                });
-        if (total_gizmo_probability > 0) {
-            results->emplace_back(&candidate, total_gizmo_probability);
+void targetSubsearchResults(EquipmentType equipment_type, GizmoType gizmo_type, level_t invention_level,
+                            GizmoResult *target__, SearchObjective objective, SubsearchProgress *progress,
+                            TopResults *results, std::atomic<probability_t> *shared_threshold,
+                            DistributionCache *distribution_cache, std::vector<Gizmo> *candidates,
+                            std::atomic<size_t> *cursor, size_t grain_size) {
+    // Candidates are in enumeration order, so consecutive ones in a chunk share most of their components.
+    GizmoPrefixState prefix_state(equipment_type, gizmo_type);
+    const CDF &budget_cdf = inventionBudgetCdf(invention_level, gizmo_type);
+    // Several kilobytes, so kept off the stack, and reused for every candidate.
+    auto distribution = std::make_unique<GizmoDistribution>();
+
+    // Claim chunks of candidates from the shared cursor until none remain. Per-candidate cost varies wildly, so
+    // threads which get cheap chunks simply come back for more.
+    for (size_t chunk_begin = cursor->fetch_add(grain_size);
+         chunk_begin < candidates->size();
+         chunk_begin = cursor->fetch_add(grain_size)) {
+        auto chunk_start = std::chrono::steady_clock::now();
+        size_t chunk_end = std::min(chunk_begin + grain_size, candidates->size());
+
+        for (size_t i = chunk_begin; i < chunk_end; ++i) {
+            evaluateCandidate((*candidates)[i], budget_cdf, *target__, objective, prefix_state, distribution.get(),
+                              distribution_cache, results, shared_threshold, progress,
+                              [](const Gizmo &candidate) { return &candidate; });
         }
-        (*results_searched)++;
+
+        progress->chunks_claimed++;
+        progress->busy_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - chunk_start).count();
     }
 }
 
 std::vector<GizmoTargetProbability> OptimalGizmoSearch::targetSearchResults(level_t invention_level,
-                                                                            size_t thread_count) {
-    int chunksize = candidate_gizmos_.size() / thread_count + 1;
+                                                                            size_t thread_count,
+                                                                            size_t grain_size,
+                                                                            size_t max_results) {
+    if (grain_size == 0) {
+        grain_size = 1;
+    }
 
-    std::vector<GizmoTargetProbability> results[thread_count];
+    std::vector<TopResults> results(thread_count, TopResults(max_results, objective_));
+    std::atomic<probability_t> shared_threshold(0);
     std::thread threads[thread_count];
+    std::atomic<size_t> cursor(0);
     thread_progress_.clear();
     thread_progress_.reserve(thread_count);
 
     for (size_t i = 0; i < thread_count; ++i) {
-        results[i].reserve(chunksize);
         SubsearchProgress &thread_progress = thread_progress_.emplace_back();
-        threads[i] = std::thread(targetSubsearchResults, invention_level, &target_, &(thread_progress.results_searched),
-                                 results + i, &candidate_gizmos_, thread_count, i);
+        threads[i] = std::thread(targetSubsearchResults, equipment_type_, gizmo_type_, invention_level, &target_,
+                                 objective_, &thread_progress, &results[i], &shared_threshold, distribution_cache_,
+                                 &candidate_gizmos_, &cursor, grain_size);
     }
 
-    std::vector<GizmoTargetProbability> resfinal;
-    resfinal.reserve(candidate_gizmos_.size());
-
     for (size_t i = 0; i < thread_count; ++i) {
         threads[i].join();
-        resfinal.insert(resfinal.end(), results[i].begin(), results[i].end());
     }
 
-    // Sort results by inverse probability.
-    std::sort(resfinal.begin(), resfinal.end(), [](const auto &a, const auto &b) {
-        if (a.target_probability == b.target_probability) {
-            size_t a_empty_count = std::count(a.gizmo->begin(), a.gizmo->end(), Component::empty);
-            size_t b_empty_count = std::count(b.gizmo->begin(), b.gizmo->end(), Component::empty);
-            return a_empty_count >= b_empty_count;
-        } else {
-            return a.target_probability > b.target_probability;
+    std::vector<GizmoTargetProbability> resfinal = TopResults::merge(results, max_results, objective_);
+    search_complete_ = true;
+
+    return resfinal;
+}
+
+// As evaluateCandidate, for every level of a sweep at once. The candidate's target pair terms are only built if its
+// upper bound could beat the results kept so far at one of the levels, and it is only offered at those levels.
+// Levels below those needed to use all of the candidate's components are skipped.
+void evaluateCandidateLevels(const Gizmo &candidate, const std::vector<level_t> &invention_levels,
+                             const std::vector<const CDF *> &budget_cdfs, const GizmoResult &target,
+                             SearchObjective objective, GizmoPrefixState &prefix_state, TargetProbabilityTerms *terms,
+                             std::vector<probability_t> *upper_bounds, std::vector<TopResults> *results,
+                             std::vector<std::atomic<probability_t>> *shared_thresholds, SubsearchProgress *progress) {
+    size_t allocations_before = threadHeapAllocations();
+    prefix_state.assign(candidate);
+    progress->results_searched++;
+
+    level_t required_level = 0;
+    for (const Component &component : candidate) {
+        required_level = std::max(required_level, component.requiredLevel());
+    }
+
+    candidate.targetProbabilityTerms(target, prefix_state, *terms);
+    bool any_possible = false;
+    for (size_t level_i = 0; level_i < budget_cdfs.size(); ++level_i) {
+        if (invention_levels[level_i] < required_level) {
+            (*upper_bounds)[level_i] = 0;
+            continue;
         }
-    });
+
+        probability_t threshold = std::max((*results)[level_i].threshold(),
+                                           (*shared_thresholds)[level_i].load(std::memory_order_relaxed));
+        probability_t upper_bound = terms->upperBound(*budget_cdfs[level_i]);
+        if (upper_bound == 0 || objectiveScore(objective, upper_bound, candidate.cost()) < threshold) {
+            upper_bound = 0;
+        }
+        (*upper_bounds)[level_i] = upper_bound;
+        any_possible = any_possible || upper_bound > 0;
+    }
+    if (!any_possible) {
+        progress->candidates_pruned++;
+        progress->heap_allocations += threadHeapAllocations() - allocations_before;
+        return;
+    }
+
+    candidate.targetPairTerms(target, *terms);
+    for (size_t level_i = 0; level_i < budget_cdfs.size(); ++level_i) {
+        if ((*upper_bounds)[level_i] == 0) {
+            continue;
+        }
+
+        probability_t total_gizmo_probability = terms->probability(*budget_cdfs[level_i]);
+        TopResults &level_results = (*results)[level_i];
+        if (total_gizmo_probability > 0 && level_results.accepts({&candidate, total_gizmo_probability})) {
+            level_results.offer({&candidate, total_gizmo_probability});
+            raiseThreshold(&(*shared_thresholds)[level_i], level_results.threshold());
+        }
+    }
+    progress->heap_allocations += threadHeapAllocations() - allocations_before;
+}
+
+void levelSweepSubsearchResults(EquipmentType equipment_type, GizmoType gizmo_type,
+                                const std::vector<level_t> *invention_levels, GizmoResult *target__,
+                                SearchObjective objective, SubsearchProgress *progress,
+                                std::vector<TopResults> *results,
+                                std::vector<std::atomic<probability_t>> *shared_thresholds,
+                                std::vector<Gizmo> *candidates, std::atomic<size_t> *cursor, size_t grain_size) {
+    GizmoPrefixState prefix_state(equipment_type, gizmo_type);
+    std::vector<const CDF *> budget_cdfs;
+    for (level_t invention_level : *invention_levels) {
+        budget_cdfs.push_back(&inventionBudgetCdf(invention_level, gizmo_type));
+    }
+    // Several kilobytes, so kept off the stack, and reused for every candidate.
+    auto terms = std::make_unique<TargetProbabilityTerms>();
+    std::vector<probability_t> upper_bounds(budget_cdfs.size());
+
+    for (size_t chunk_begin = cursor->fetch_add(grain_size);
+         chunk_begin < candidates->size();
+         chunk_begin = cursor->fetch_add(grain_size)) {
+        auto chunk_start = std::chrono::steady_clock::now();
+        size_t chunk_end = std::min(chunk_begin + grain_size, candidates->size());
+
+        for (size_t i = chunk_begin; i < chunk_end; ++i) {
+            evaluateCandidateLevels((*candidates)[i], *invention_levels, budget_cdfs, *target__, objective,
+                                    prefix_state, terms.get(), &upper_bounds, results, shared_thresholds, progress);
+        }
+
+        progress->chunks_claimed++;
+        progress->busy_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - chunk_start).count();
+    }
+}
+
+std::vector<LevelSweepResults> OptimalGizmoSearch::levelSweepResults(const std::vector<level_t> &invention_levels,
+                                                                     int thread_count,
+                                                                     size_t grain_size,
+                                                                     size_t max_results) {
+    if (grain_size == 0) {
+        grain_size = 1;
+    }
+
+    std::vector<std::vector<TopResults>> results(
+            thread_count, std::vector<TopResults>(invention_levels.size(), TopResults(max_results, objective_)));
+    std::vector<std::atomic<probability_t>> shared_thresholds(invention_levels.size());
+    for (std::atomic<probability_t> &shared_threshold : shared_thresholds) {
+        shared_threshold = 0;
+    }
+    std::vector<std::thread> threads;
+    std::atomic<size_t> cursor(0);
+    thread_progress_.clear();
+    thread_progress_.reserve(thread_count);
+
+    for (int i = 0; i < thread_count; ++i) {
+        SubsearchProgress &thread_progress = thread_progress_.emplace_back();
+        threads.emplace_back(levelSweepSubsearchResults, equipment_type_, gizmo_type_, &invention_levels, &target_,
+                             objective_, &thread_progress, &results[i], &shared_thresholds, &candidate_gizmos_,
+                             &cursor, grain_size);
+    }
+
+    for (int i = 0; i < thread_count; ++i) {
+        threads[i].join();
+    }
+
+    std::vector<LevelSweepResults> sweep;
+    sweep.reserve(invention_levels.size());
+    for (size_t level_i = 0; level_i < invention_levels.size(); ++level_i) {
+        std::vector<TopResults> level_parts;
+        level_parts.reserve(thread_count);
+        for (int i = 0; i < thread_count; ++i) {
+            level_parts.push_back(std::move(results[i][level_i]));
+        }
+        sweep.push_back({invention_levels[level_i], TopResults::merge(level_parts, max_results, objective_)});
+    }
+    search_complete_ = true;
+
+    return sweep;
+}
+
+void streamSubsearchResults(EquipmentType equipment_type, GizmoType gizmo_type, level_t invention_level,
+                            GizmoResult *target__, SearchObjective objective, SubsearchProgress *progress,
+                            TopResults *results, std::atomic<probability_t> *shared_threshold,
+                            DistributionCache *distribution_cache, std::deque<Gizmo> *retained,
+                            BoundedQueue<std::vector<Gizmo>> *batches) {
+    GizmoPrefixState prefix_state(equipment_type, gizmo_type);
+    const CDF &budget_cdf = inventionBudgetCdf(invention_level, gizmo_type);
+    auto distribution = std::make_unique<GizmoDistribution>();
+
+    std::vector<Gizmo> batch;
+    while (batches->pop(batch)) {
+        auto batch_start = std::chrono::steady_clock::now();
+
+        for (const Gizmo &candidate : batch) {
+            evaluateCandidate(candidate, budget_cdf, *target__, objective, prefix_state, distribution.get(),
+                              distribution_cache, results, shared_threshold, progress, [&](const Gizmo &kept) {
+                        // The batch is about to be discarded, so keep our own copy of the gizmo.
+                        retained->push_back(kept);
+                        return &retained->back();
+                    });
+        }
+
+        progress->chunks_claimed++;
+        progress->busy_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - batch_start).count();
+    }
+}
+
+std::vector<GizmoTargetProbability> OptimalGizmoSearch::streamResults(const std::vector<Component> &excluded,
+                                                                      level_t invention_level,
+                                                                      int thread_count,
+                                                                      size_t batch_size,
+                                                                      size_t max_results) {
+    search_complete_ = false;
+    total_candidates = 0;
+    candidate_gizmos_.clear();
+    if (batch_size == 0) {
+        batch_size = 1;
+    }
+    // Candidates are only taken off the queue by evaluator threads, so without one the first full queue would block
+    // generation forever.
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+
+    // Two batches per evaluator is enough to keep them busy while the next batch is generated.
+    BoundedQueue<std::vector<Gizmo>> batches(2 * thread_count);
+
+    std::vector<TopResults> results(thread_count, TopResults(max_results, objective_));
+    std::atomic<probability_t> shared_threshold(0);
+    std::vector<std::thread> threads;
+    retained_gizmos_.clear();
+    retained_gizmos_.resize(thread_count);
+    thread_progress_.clear();
+    thread_progress_.reserve(thread_count);
+
+    for (int i = 0; i < thread_count; ++i) {
+        SubsearchProgress &thread_progress = thread_progress_.emplace_back();
+        threads.emplace_back(streamSubsearchResults, equipment_type_, gizmo_type_, invention_level, &target_,
+                             objective_, &thread_progress, &results[i], &shared_threshold, distribution_cache_,
+                             &retained_gizmos_[i], &batches);
+    }
+
+    // Generate candidates on this thread, handing them off a batch at a time. As evaluation runs alongside, the
+    // results found so far can also cut off expensive prefixes when searching by expected cost.
+    std::vector<Component> possible_components = targetPossibleComponents(excluded, invention_level);
+    std::vector<Gizmo> batch;
+    batch.reserve(batch_size);
+    enumerateCandidates(possible_components, 0, possible_components.size() * possible_components.size(),
+                        [&](const std::vector<Component> &configuration) {
+        batch.emplace_back(equipment_type_, gizmo_type_, configuration);
+        total_candidates++;
+        if (batch.size() >= batch_size) {
+            batches.push(std::move(batch));
+            batch = std::vector<Gizmo>();
+            batch.reserve(batch_size);
+        }
+    }, &shared_threshold);
+    if (!batch.empty()) {
+        batches.push(std::move(batch));
+    }
+    batches.close();
+
+    for (int i = 0; i < thread_count; ++i) {
+        threads[i].join();
+    }
+
+    std::vector<GizmoTargetProbability> resfinal = TopResults::merge(results, max_results, objective_);
+    search_complete_ = true;
 
     return resfinal;
 }
@@ -6,30 +6,100 @@
 #define RSPERKS_OPTIMALGIZMOSEARCH_H
 
 #include <atomic>
+#include <deque>
+#include <functional>
 
 #include "InventionTypes.h"
 #include "Gizmo.h"
 #include "Component.h"
 
 
+// What the search ranks gizmos by.
+enum SearchObjective {
+    // Highest chance of generating the target.
+    MAX_PROBABILITY,
+    // Lowest expected component cost to generate the target, i.e. cost / probability.
+    MIN_EXPECTED_COST
+};
+
+std::ostream &operator<<(std::ostream &strm, const SearchObjective &objective);
+
+class DistributionCache;
+
+
 struct GizmoTargetProbability {
-    GizmoTargetProbability(const Gizmo *g, probability_t p) : gizmo(g), target_probability(p) {}
+    GizmoTargetProbability(const Gizmo *g, probability_t p);
 
     const Gizmo *gizmo;
     probability_t target_probability;
+    // Used to break ties in favour of cheaper gizmos, so it is counted once up front.
+    size_t empty_slots;
+    size_t cost;
+
+    // Higher is better. For expected cost this is probability / cost, the inverse of the expected cost.
+    [[nodiscard]] probability_t score(SearchObjective objective) const;
 };
 
 std::ostream &operator<<(std::ostream &strm, const GizmoTargetProbability &result);
 
+// Score for a gizmo of the given cost and probability.
+probability_t objectiveScore(SearchObjective objective, probability_t probability, size_t cost);
+
+// Result ordering: higher score first, then more empty slots.
+bool betterResult(const GizmoTargetProbability &a, const GizmoTargetProbability &b,
+                  SearchObjective objective = MAX_PROBABILITY);
+
+
+// Collects the best results seen so far, keeping at most a fixed number of them.
+// A limit of zero keeps everything.
+class TopResults {
+public:
+    explicit TopResults(size_t limit = 0, SearchObjective objective = MAX_PROBABILITY);
+
+    // Whether a result would currently be kept.
+    [[nodiscard]] bool accepts(const GizmoTargetProbability &result) const;
+
+    void offer(const GizmoTargetProbability &result);
+
+    // Score a result must reach to have any chance of being kept. Zero until the limit has been reached.
+    [[nodiscard]] probability_t threshold() const;
+
+    // Merge other collections into one, best first, applying the limit.
+    static std::vector<GizmoTargetProbability> merge(std::vector<TopResults> &parts, size_t limit,
+                                                     SearchObjective objective = MAX_PROBABILITY);
+
+private:
+    size_t limit_;
+    SearchObjective objective_;
+    // Heap with the worst kept result at the front, when limited.
+    std::vector<GizmoTargetProbability> results_;
+};
+
+
+// Best results of a level sweep at one invention level.
+struct LevelSweepResults {
+    level_t invention_level;
+    std::vector<GizmoTargetProbability> results;
+};
+
 
 // Struct to store search progress information.
 // Deliberately increased size to 64-bytes to ensure instances reside in different cache lines.
 struct SubsearchProgress {
-    // 8 bytes
-    int64_t results_searched;
-
-    // 7 * 8 bytes of padding
-    int64_t padding__[7] = {0};
+    // 4 * 8 bytes
+    int64_t results_searched = 0;
+    int64_t chunks_claimed = 0;
+    // Time spent evaluating candidates, excluding any time waiting for work.
+    int64_t busy_nanoseconds = 0;
+    // Candidates skipped because their upper bound could not beat the current results.
+    int64_t candidates_pruned = 0;
+
+    // 1 * 8 bytes
+    // Heap allocations made while evaluating candidates. Only counted with RSPERKS_COUNT_ALLOCATIONS.
+    int64_t heap_allocations = 0;
+
+    // 3 * 8 bytes of padding
+    int64_t padding__[3] = {0};
 };
 
 
@@ -37,30 +107,108 @@ class OptimalGizmoSearch {
 public:
     OptimalGizmoSearch(EquipmentType equipment,
                        GizmoType gizmo_type,
-                       GizmoResult target);
+                       GizmoResult target,
+                       SearchObjective objective = MAX_PROBABILITY);
+
+    // With more than one thread, generation is split up by the leading components of the candidates.
+    // Components which need a higher invention level than max_level are left out.
+    size_t build_candidate_list(const std::vector<Component> &excluded,
+                                int thread_count = 1,
+                                level_t max_level = std::numeric_limits<level_t>::max());
+
+    // Threads claim candidates in contiguous chunks of grain_size from a shared cursor.
+    // When max_results is non-zero only the best max_results are kept. The candidate list should be built with the
+    // same invention level, so that components which cannot be used yet are left out.
+    std::vector<GizmoTargetProbability> results(level_t invention_level,
+                                                int thread_count = 1,
+                                                size_t grain_size = 16,
+                                                size_t max_results = 0);
+
+    // Pipelined alternative to build_candidate_list + results. Candidates are generated on the calling thread and
+    // handed to the evaluator threads in batches as they are found, so at most a few batches are held in memory.
+    // At least one evaluator thread is always started.
+    std::vector<GizmoTargetProbability> streamResults(const std::vector<Component> &excluded,
+                                                      level_t invention_level,
+                                                      int thread_count = 1,
+                                                      size_t batch_size = 1024,
+                                                      size_t max_results = 0);
+
+    // Evaluates the candidates from build_candidate_list at every one of the given invention levels in a single pass,
+    // skipping each candidate at the levels too low to use all of its components.
+    // Each candidate's perk distributions, rank probabilities and perk combinations are worked out once and only the
+    // budget step is repeated per level, so this costs far less than one search per level. Each level keeps its own
+    // best max_results, the same results a separate search at that level would give, up to rounding.
+    std::vector<LevelSweepResults> levelSweepResults(const std::vector<level_t> &invention_levels,
+                                                     int thread_count = 1,
+                                                     size_t grain_size = 16,
+                                                     size_t max_results = 0);
+
+    // The candidates from the most recent build_candidate_list, in Gizmo Normal Form.
+    const std::vector<Gizmo> &candidates() const;
 
-    size_t build_candidate_list(const std::vector<Component> &excluded);
+    size_t resultsSearched();
 
-    std::vector<GizmoTargetProbability> results(level_t invention_level, int thread_count = 1);
+    // Per-thread statistics for the most recent search.
+    const std::vector<SubsearchProgress> &threadProgress() const;
 
-    size_t resultsSearched();
+    bool searchComplete() const;
 
-    size_t total_candidates;
+    // Shares candidate distributions with other searches through a cache, which must outlive the searches using it.
+    // Worth it when searching for many targets on the same equipment and gizmo type. Used by results and
+    // streamResults; nullptr, the default, turns it off.
+    void useDistributionCache(DistributionCache *cache);
+
+    // In streaming mode this grows as candidates are generated.
+    std::atomic<size_t> total_candidates;
 
 private:
+    // Times candidate generation and evaluation on their own.
+    friend struct GizmoBenchmarks;
+
     EquipmentType equipment_type_;
     GizmoType gizmo_type_;
     GizmoResult target_;
+    SearchObjective objective_;
+    DistributionCache *distribution_cache_ = nullptr;
 
     std::vector<Gizmo> candidate_gizmos_;
 
-    std::vector<SubsearchProgress> thread_progress_;
-
-    std::vector<Component> targetPossibleComponents(const std::vector<Component> &excluded) const;
+    // Streamed candidates are discarded after evaluation, so any with a result are copied here to keep them alive.
+    std::vector<std::deque<Gizmo>> retained_gizmos_;
 
-    std::vector<Gizmo> candidateGizmos(const std::vector<Component> &excluded) const;
+    std::vector<SubsearchProgress> thread_progress_;
 
-    std::vector<GizmoTargetProbability> targetSearchResults(level_t invention_level, size_t thread_count = 1);
+    std::atomic<bool> search_complete_;
+
+    // Components which can contribute to the target, are not excluded, and can be used at max_level.
+    std::vector<Component> targetPossibleComponents(const std::vector<Component> &excluded, level_t max_level) const;
+
+    std::vector<Gizmo> candidateGizmos(const std::vector<Component> &excluded, level_t max_level) const;
+
+    std::vector<Gizmo> parallelCandidateGizmos(const std::vector<Component> &excluded,
+                                               int thread_count,
+                                               level_t max_level) const;
+
+    // Calls emit with each normal form candidate configuration, in order of their component indices.
+    void enumerateCandidates(const std::vector<Component> &excluded,
+                             level_t max_level,
+                             const std::function<void(const std::vector<Component> &)> &emit) const;
+
+    // As above, limited to candidates whose first two component indices (as index[0] * n + index[1]) fall within
+    // [prefix_begin, prefix_end).
+    // When searching by expected cost, a score threshold may be given to cut off prefixes which already cost too
+    // much to beat the results found so far. Only streamResults has any results while generating, so it is the only
+    // search which passes one.
+    void enumerateCandidates(const std::vector<Component> &possible_components,
+                             size_t prefix_begin,
+                             size_t prefix_end,
+                             const std::function<void(const std::vector<Component> &)> &emit,
+                             const std::atomic<probability_t> *score_threshold = nullptr) const;
+
+    std::vector<GizmoTargetProbability> targetSearchResults(level_t invention_level,
+                                                            size_t thread_count = 1,
+                                                            size_t grain_size = 16,
+                                                            size_t max_results = 0);
 };
 
 
@@ -3,6 +3,10 @@
 //
 
 #include "Perk.h"
+#include "DataImage.h"
+#ifdef RSPERKS_EMBED_DATA
+#include "EmbeddedData.h"
+#endif
 #include <fstream>
 #include <sstream>
 
@@ -11,12 +15,20 @@ std::string Perk::name() const {
     return Perk::perk_names_.at(this->id);
 }
 
-rank_list_t &Perk::ranks() const {
-    return Perk::perk_ranks_[this->id];
+const rank_list_t &Perk::ranks() const {
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::perk_tables.ranks[this->id];
+#else
+    return Perk::perk_tables_->ranks[this->id];
+#endif
 }
 
 bool Perk::twoSlot() const {
-    return Perk::perk_is_two_slot_[this->id];
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::perk_tables.two_slot[this->id];
+#else
+    return Perk::perk_tables_->two_slot[this->id];
+#endif
 }
 
 Rank Perk::rank(rank_t rank) const {
@@ -32,7 +44,11 @@ std::vector<Perk> &Perk::all() {
 }
 
 Perk Perk::get(perk_id_t id) {
+#ifdef RSPERKS_EMBED_DATA
+    return rs::embedded::perks_by_id[id];
+#else
     return Perk::perks_by_id_[id];
+#endif
 }
 
 Perk Perk::get(std::string name) {
@@ -46,7 +62,7 @@ size_t Perk::registerPerks(std::string filename) {
         perks_by_id_[no_effect_id] = no_effect;
         perks_by_name_.insert({"No Effect", no_effect});
         perk_names_.insert({no_effect_id, "No Effect"});
-        perk_is_two_slot_[no_effect_id] = false;
+        perk_table_storage_.two_slot[no_effect_id] = false;
     }
 
     std::ifstream perk_data_file;
@@ -94,29 +110,81 @@ size_t Perk::registerPerks(std::string filename) {
             perks_by_id_[perk_id] = new_perk;
             perks_by_name_.insert({perk_name, new_perk});
             perk_names_.insert({perk_id, perk_name});
-            perk_is_two_slot_[perk_id] = (perk_name == "Enhanced Devoted" || perk_name == "Enhanced Efficient");
-            perk_ranks_[perk_id][0] = {0, 0, 0, false};
+            perk_table_storage_.two_slot[perk_id] = (perk_name == "Enhanced Devoted" ||
+                                                     perk_name == "Enhanced Efficient");
+            perk_table_storage_.ranks[perk_id][0] = {0, 0, 0, false};
         }
 
         // Add rank information.
-        perk_ranks_[perk_id][perk_rank] = {perk_rank, perk_cost, perk_threshold, ancient};
+        perk_table_storage_.ranks[perk_id][perk_rank] = {perk_rank, perk_cost, perk_threshold, ancient};
         rank_t max_rank = std::max(perks_by_id_[perk_id].max_rank, perk_rank);
         perks_by_id_[perk_id].max_rank = max_rank;
         perks_by_name_[perk_name].max_rank = max_rank;
     }
 
+    // Perks are listed when their first rank is read, so give them their final max rank too.
+    for (Perk &perk : all_) {
+        perk.max_rank = perks_by_id_[perk.id].max_rank;
+    }
+
+    return 0;
+}
+
+size_t Perk::registerPerks(const DataImage &image) {
+    // The image lists every perk, No Effect included, in the order they were registered when it was built.
+    perk_tables_ = &image.perkTables();
+    all_.reserve(image.perks().size());
+    perk_names_.reserve(image.perks().size());
+    perks_by_name_.reserve(image.perks().size());
+    for (const DataImage::PerkRecord &record : image.perks()) {
+        Perk perk = {record.id, record.max_rank};
+        std::string perk_name = image.string(record.name);
+        all_.push_back(perk);
+        perks_by_id_[record.id] = perk;
+        perks_by_name_.insert({perk_name, perk});
+        perk_names_.insert({record.id, std::move(perk_name)});
+    }
+
+    return 0;
+}
+
+const PerkTables &Perk::tables() {
+    return *perk_tables_;
+}
+
+#ifdef RSPERKS_EMBED_DATA
+size_t Perk::registerEmbedded() {
+    // The per ID tables are constants already, so only the lists and name lookups need building.
+    perk_tables_ = &rs::embedded::perk_tables;
+    all_.reserve(rs::embedded::perks.size());
+    for (const rs::embedded::EmbeddedPerk &embedded : rs::embedded::perks) {
+        Perk perk = {embedded.id, embedded.max_rank};
+        all_.push_back(perk);
+        perks_by_id_[embedded.id] = perk;
+        perks_by_name_.insert({std::string(embedded.name), perk});
+        perk_names_.insert({embedded.id, std::string(embedded.name)});
+    }
+
     return 0;
 }
+#endif
 
 std::vector<Perk> Perk::all_;
 
 std::unordered_map<perk_id_t, std::string> Perk::perk_names_;
-std::array<rank_list_t, std::numeric_limits<perk_id_t>::max()> Perk::perk_ranks_;
-std::array<bool, std::numeric_limits<perk_id_t>::max()> Perk::perk_is_two_slot_;
+PerkTables Perk::perk_table_storage_;
+const PerkTables *Perk::perk_tables_ = &Perk::perk_table_storage_;
 
 std::array<Perk, std::numeric_limits<perk_id_t>::max()> Perk::perks_by_id_;
 std::unordered_map<std::string, Perk> Perk::perks_by_name_;
 
+#ifdef RSPERKS_EMBED_DATA
+namespace {
+    // Must come after the definitions above, which are initialised in order.
+    const size_t embedded_perks_registered = Perk::registerEmbedded();
+}
+#endif
+
 std::ostream &operator<<(std::ostream &strm, const Perk &perk) {
     return strm << perk.name();
 }
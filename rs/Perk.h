@@ -23,13 +23,21 @@ struct Rank {
 
 typedef std::array<Rank, 7> rank_list_t;
 
+// Per perk data, indexed by perk ID. Flat and trivially copyable, so it can be used directly from a data image.
+struct PerkTables {
+    std::array<rank_list_t, std::numeric_limits<perk_id_t>::max()> ranks;
+    std::array<bool, std::numeric_limits<perk_id_t>::max()> two_slot;
+};
+
+class DataImage;
+
 struct Perk {
     perk_id_t id;
     rank_t max_rank;
 
     [[nodiscard]] std::string name() const;
 
-    [[nodiscard]] rank_list_t &ranks() const;
+    [[nodiscard]] const rank_list_t &ranks() const;
 
     [[nodiscard]] bool twoSlot() const;
 
@@ -47,12 +55,23 @@ struct Perk {
 
     static size_t registerPerks(std::string filename);
 
+    // Registers the perks from a data image, using its tables in place. Use instead of the data file, not as well.
+    static size_t registerPerks(const DataImage &image);
+
+    [[nodiscard]] static const PerkTables &tables();
+
+#ifdef RSPERKS_EMBED_DATA
+    // Registers the data compiled into the tool. This runs before main, so the tools do not need to call it.
+    static size_t registerEmbedded();
+#endif
+
 private:
     static std::vector<Perk> all_;
 
     static std::unordered_map<perk_id_t, std::string> perk_names_;
-    static std::array<rank_list_t, std::numeric_limits<perk_id_t>::max()> perk_ranks_;
-    static std::array<bool, std::numeric_limits<perk_id_t>::max()> perk_is_two_slot_;
+    // Points at perk_table_storage_, unless the perks came from a data image.
+    static PerkTables perk_table_storage_;
+    static const PerkTables *perk_tables_;
 
     static std::array<Perk, std::numeric_limits<perk_id_t>::max()> perks_by_id_;
     static std::unordered_map<std::string, Perk> perks_by_name_;
@@ -6,20 +6,26 @@
 #define RSPERKS_PROBABILITY_H
 
 #include "InventionTypes.h"
+#include "SimdKernels.h"
 #include <vector>
 #include <array>
 #include <numeric>
 #include <algorithm>
+#include <cassert>
+#include <limits>
+#include <memory>
+#include <mutex>
 
 typedef std::vector<probability_t> PDF;
 typedef std::vector<probability_t> CDF;
 
+// Convolve into an existing vector, reusing its capacity. out must not alias a or b.
 template<typename T>
-inline std::vector<T> convolve(const std::vector<T> &a, const std::vector<T> &b) {
+inline void convolve(const std::vector<T> &a, const std::vector<T> &b, std::vector<T> &out) {
     size_t a_len = a.size();
     size_t b_len = b.size();
     size_t result_size = a_len + b_len - 1;
-    std::vector<T> out(result_size, T());
+    out.assign(result_size, T());
     for (size_t i = 0; i < result_size; ++i) {
         size_t j_min = (i > b_len - 1) ? i - b_len + 1 : 0;
         size_t j_max = (i < a_len - 1) ? i : a_len - 1;
@@ -27,47 +33,161 @@ inline std::vector<T> convolve(const std::vector<T> &a, const std::vector<T> &b)
             out[i] += a[j] * b[i - j];
         }
     }
+}
+
+template<typename T>
+inline std::vector<T> convolve(const std::vector<T> &a, const std::vector<T> &b) {
+    std::vector<T> out;
+    convolve(a, b, out);
     return out;
 }
 
+/**
+ * Distribution of a sum of independent uniform rolls, each over [0, roll).
+ *
+ * Rather than convolving floating point PDFs, this keeps the exact number of ways each total can be rolled. Adding a
+ * roll is then a sliding window sum over those counts, done in place as a difference of prefix sums in O(n + roll)
+ * rather than O(n * roll). Every probability is a single correctly rounded division, so results agree with the naive
+ * convolution to within its own rounding error (a few ulps) and the CDF ends at exactly 1.
+ *
+ * Counts are exact as long as the product of the roll sizes fits in 64 bits. That holds comfortably for the data: at
+ * most nine component rolls of at most 50, and at most six budget rolls of at most 88.
+ */
+class UniformSumDistribution {
+public:
+    void clear() {
+        counts_.clear();
+        total_ = 1;
+    }
+
+    void reserve(size_t size) {
+        counts_.reserve(size);
+    }
+
+    void add(size_t roll) {
+        assert(roll > 0);
+        assert(total_ <= std::numeric_limits<uint64_t>::max() / roll);
+        total_ *= roll;
+
+        size_t size = counts_.size();
+        if (size == 0) {
+            counts_.assign(roll, 1);
+            return;
+        }
+
+        // counts[i] = sum of counts[i - roll + 1 .. i], as prefix[i] - prefix[i - roll].
+        counts_.resize(size + roll - 1);
+        rs::simd::boxSum(counts_.data(), size, roll);
+    }
+
+    [[nodiscard]] bool empty() const {
+        return counts_.empty();
+    }
+
+    [[nodiscard]] size_t size() const {
+        return counts_.size();
+    }
+
+    // Number of ways to roll each total, out of total().
+    [[nodiscard]] const std::vector<uint64_t> &counts() const {
+        return counts_;
+    }
+
+    [[nodiscard]] uint64_t total() const {
+        return total_;
+    }
+
+    void appendPdf(PDF &out) const {
+        auto total = static_cast<probability_t>(total_);
+        for (uint64_t count : counts_) {
+            out.push_back(static_cast<probability_t>(count) / total);
+        }
+    }
+
+    void appendCdf(CDF &out) const {
+        size_t offset = out.size();
+        out.resize(offset + counts_.size());
+        rs::simd::cumulativeProbabilities(counts_.data(), counts_.size(), total_, out.data() + offset);
+    }
+
+private:
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 1;
+};
+
+template<typename T>
+inline UniformSumDistribution uniformSum(const std::vector<T> &rolls) {
+    UniformSumDistribution distribution;
+    for (T roll : rolls) {
+        distribution.add(roll);
+    }
+    return distribution;
+}
+
 template<typename T>
 inline PDF Pdf(const std::vector<T> &rolls) {
-    PDF pdf(static_cast<probability_t>(rolls[0]), 1.0 / static_cast<probability_t>(rolls[0]));
-    std::for_each(rolls.begin() + 1, rolls.end(), [&pdf](T roll) {
-        PDF other(static_cast<probability_t>(roll), 1.0 / static_cast<probability_t>(roll));
-        pdf = convolve(pdf, other);
-    });
+    PDF pdf;
+    uniformSum(rolls).appendPdf(pdf);
     return pdf;
 }
 
 template<typename T>
 inline CDF Cdf(const std::vector<T> &rolls) {
-    PDF pdf = Pdf(rolls);
-    CDF cdf(pdf.size());
-    std::partial_sum(pdf.begin(), pdf.end(), cdf.begin());
+    CDF cdf;
+    uniformSum(rolls).appendCdf(cdf);
     return cdf;
 }
 
-inline std::array<bool, std::numeric_limits<level_t>::max()> __inv_cache_built;
-inline std::array<CDF, std::numeric_limits<level_t>::max()> __inv_cache_cdf;
+// The CDFs as the plain pointers the per-perk calculations take, which also serve CDFs owned by a GizmoPrefixState.
+inline std::vector<const CDF *> cdfPointers(const std::vector<std::shared_ptr<const CDF>> &cdfs) {
+    std::vector<const CDF *> pointers;
+    pointers.reserve(cdfs.size());
+    for (const std::shared_ptr<const CDF> &cdf : cdfs) {
+        pointers.push_back(cdf.get());
+    }
+    return pointers;
+}
 
-inline CDF inventionBudgetCdf(level_t invention_level, bool ancient) {
-    if (__inv_cache_built[invention_level]) {
-        return __inv_cache_cdf[invention_level];
+/**
+ * Invention budget CDFs for every invention level and gizmo type.
+ *
+ * Each CDF is built the first time it is asked for, under std::call_once, and never changes afterwards, so the
+ * references handed out stay valid for the life of the program and can be shared freely between threads.
+ */
+class InventionBudgetTable {
+public:
+    static constexpr size_t level_count = size_t(std::numeric_limits<level_t>::max()) + 1;
+
+    static const CDF &get(level_t invention_level, GizmoType gizmo_type) {
+        static InventionBudgetTable table;
+        Entry &entry = table.entries_[gizmo_type == ANCIENT][invention_level];
+        std::call_once(entry.built, [&] { entry.cdf = build(invention_level, gizmo_type); });
+        return entry.cdf;
     }
 
-    level_t inv_budget_roll_max = invention_level / 2 + 20;
-    PDF budget_pdf = Pdf(std::vector<level_t>(ancient ? 6 : 5, inv_budget_roll_max));
-    for (size_t i = 0; i < invention_level; ++i) {
-        budget_pdf[invention_level] += budget_pdf[i];
-        budget_pdf[i] = 0;
+private:
+    struct Entry {
+        std::once_flag built;
+        CDF cdf;
+    };
+
+    static CDF build(level_t invention_level, GizmoType gizmo_type) {
+        level_t inv_budget_roll_max = invention_level / 2 + 20;
+        std::vector<level_t> rolls(gizmo_type == ANCIENT ? 6 : 5, inv_budget_roll_max);
+
+        // Budgets below the invention level are raised to it, so everything below the level is zero and the CDF jumps
+        // straight to P(roll <= level) there.
+        CDF budget_cdf;
+        uniformSum(rolls).appendCdf(budget_cdf);
+        std::fill(budget_cdf.begin(), budget_cdf.begin() + invention_level, 0);
+        return budget_cdf;
     }
-    CDF budget_cdf(budget_pdf.size());
-    std::partial_sum(budget_pdf.begin(), budget_pdf.end(), budget_cdf.begin());
 
-    __inv_cache_cdf[invention_level] = budget_cdf;
-    __inv_cache_built[invention_level] = true;
-    return budget_cdf;
+    std::array<std::array<Entry, level_count>, 2> entries_;
+};
+
+inline const CDF &inventionBudgetCdf(level_t invention_level, GizmoType gizmo_type) {
+    return InventionBudgetTable::get(invention_level, gizmo_type);
 }
 
 #endif //RSPERKS_PROBABILITY_H
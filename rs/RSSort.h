@@ -44,10 +44,10 @@ namespace rs {
         innerQs(start, begin, end - 1, value_fn);
     }
 
-    template<typename A, typename F>
-    void safeQuicksort(int low, int high, std::vector<A> &arr, F value_fn) {
+    template<typename C, typename F>
+    void safeQuicksort(int low, int high, C &arr, F value_fn) {
         int pivot_index = (low + high) / 2;
-        A pivot_value = arr[pivot_index];
+        auto pivot_value = arr[pivot_index];
         arr[pivot_index] = arr[high];
         arr[high] = pivot_value;
         int counter = low;
@@ -58,7 +58,7 @@ namespace rs {
             // Therefore, the alternating <=/< would be the wrong way round.
             // This perhaps isn't the most elegant or portable solution at the moment.
             if (value_fn(arr[loop_index]) - value_fn(pivot_value) < ((loop_index + 1) & 1)) {
-                A tmp = arr[loop_index];
+                auto tmp = arr[loop_index];
                 arr[loop_index] = arr[counter];
                 arr[counter] = tmp;
                 counter++;
@@ -0,0 +1,215 @@
+#include "ResultCache.h"
+#include "MappedFile.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <sstream>
+
+
+namespace {
+    constexpr char file_magic[4] = {'R', 'S', 'G', 'C'};
+
+    // Every gizmo is stored with nine component slots, unused ones holding the empty component.
+    constexpr size_t stored_slots = 9;
+
+    uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<uint8_t>(data[i]);
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Fixed width little endian integers, so files do not depend on the host.
+    template<typename T>
+    void put(std::string &out, T value) {
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            out.push_back(static_cast<char>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    template<typename T>
+    bool get(const std::string &in, size_t &offset, T &value) {
+        if (offset > in.size() || in.size() - offset < sizeof(T)) {
+            return false;
+        }
+        uint64_t result = 0;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            result |= static_cast<uint64_t>(static_cast<uint8_t>(in[offset + i])) << (8 * i);
+        }
+        value = static_cast<T>(result);
+        offset += sizeof(T);
+        return true;
+    }
+
+    void putProbability(std::string &out, probability_t probability) {
+        uint64_t bits;
+        std::memcpy(&bits, &probability, sizeof(bits));
+        put(out, bits);
+    }
+
+    bool getProbability(const std::string &in, size_t &offset, probability_t &probability) {
+        uint64_t bits;
+        if (!get(in, offset, bits)) {
+            return false;
+        }
+        std::memcpy(&probability, &bits, sizeof(bits));
+        return true;
+    }
+
+    bool knownComponent(component_id_t id) {
+        return std::any_of(Component::all().begin(), Component::all().end(),
+                           [id](const Component &component) { return component.id == id; });
+    }
+}
+
+ResultCache::ResultCache(std::string directory, uint64_t data_hash) :
+        directory_(std::move(directory)),
+        data_hash_(data_hash) {
+
+}
+
+std::string ResultCache::queryKey(const ResultCacheQuery &query) const {
+    std::string key;
+    put<uint8_t>(key, query.equipment_type);
+    put<uint8_t>(key, query.gizmo_type);
+    put<uint8_t>(key, query.invention_level);
+    put<uint8_t>(key, query.objective);
+    for (const GeneratedPerk &target_perk : {query.target.first, query.target.second}) {
+        put<perk_id_t>(key, target_perk.perk.id);
+        put<rank_t>(key, target_perk.rank);
+    }
+
+    std::vector<component_id_t> excluded;
+    for (const Component &component : query.excluded) {
+        excluded.push_back(component.id);
+    }
+    std::sort(excluded.begin(), excluded.end());
+    excluded.erase(std::unique(excluded.begin(), excluded.end()), excluded.end());
+    put<uint16_t>(key, excluded.size());
+    for (component_id_t id : excluded) {
+        put<component_id_t>(key, id);
+    }
+    return key;
+}
+
+std::string ResultCache::queryPath(const std::string &key) const {
+    std::string named = key;
+    put(named, data_hash_);
+    uint64_t hash = fnv1a(named.data(), named.size());
+    std::stringstream name;
+    name << std::hex << std::setw(16) << std::setfill('0') << hash << ".rsgc";
+    return (std::filesystem::path(directory_) / name.str()).string();
+}
+
+bool ResultCache::load(const ResultCacheQuery &query, std::vector<CachedResult> &results) const {
+    std::string key = queryKey(query);
+    std::ifstream file(queryPath(key), std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    // Header: magic, version, data hash, then the query key in full, as the file name is only a hash of it.
+    size_t offset = 0;
+    uint16_t version;
+    uint64_t data_hash;
+    uint16_t key_size;
+    if (contents.compare(0, sizeof(file_magic), file_magic, sizeof(file_magic)) != 0) {
+        return false;
+    }
+    offset += sizeof(file_magic);
+    if (!get(contents, offset, version) || version != format_version ||
+        !get(contents, offset, data_hash) || data_hash != data_hash_ ||
+        !get(contents, offset, key_size) || key_size != key.size() ||
+        contents.compare(offset, key_size, key) != 0) {
+        return false;
+    }
+    offset += key_size;
+
+    // Results, best first, with the limit they were searched with.
+    uint32_t stored_max_results;
+    uint32_t count;
+    if (!get(contents, offset, stored_max_results) || !get(contents, offset, count)) {
+        return false;
+    }
+    // Fewer results than the limit means there were no more to find.
+    bool covers_query = stored_max_results == 0 || count < stored_max_results ||
+                        (query.max_results != 0 && query.max_results <= stored_max_results);
+    if (!covers_query || contents.size() - offset != count * (stored_slots + sizeof(uint64_t))) {
+        return false;
+    }
+
+    size_t wanted = query.max_results == 0 ? count : std::min<size_t>(count, query.max_results);
+    std::vector<CachedResult> loaded;
+    loaded.reserve(wanted);
+    for (size_t i = 0; i < wanted; ++i) {
+        std::vector<Component> components;
+        for (size_t slot = 0; slot < stored_slots; ++slot) {
+            component_id_t id;
+            get(contents, offset, id);
+            if (id != empty_component_id && !knownComponent(id)) {
+                return false;
+            }
+            if (slot < slotsForType(query.gizmo_type)) {
+                components.push_back(id == empty_component_id ? Component::empty : Component::get(id));
+            }
+        }
+
+        probability_t probability;
+        getProbability(contents, offset, probability);
+        if (!std::isfinite(probability) || probability < 0 || probability > 1) {
+            return false;
+        }
+        loaded.push_back({Gizmo(query.equipment_type, query.gizmo_type, components), probability});
+    }
+
+    results = std::move(loaded);
+    return true;
+}
+
+bool ResultCache::store(const ResultCacheQuery &query, const std::vector<GizmoTargetProbability> &results) const {
+    // max_results is not part of the key, so a query for fewer results must not replace a stored file which already
+    // answers it, as that file may hold more results than these.
+    std::vector<CachedResult> stored;
+    if (load(query, stored)) {
+        return true;
+    }
+
+    std::string key = queryKey(query);
+    std::string contents(file_magic, sizeof(file_magic));
+    put(contents, format_version);
+    put(contents, data_hash_);
+    put<uint16_t>(contents, key.size());
+    contents += key;
+    put<uint32_t>(contents, query.max_results);
+    put<uint32_t>(contents, results.size());
+    for (const GizmoTargetProbability &result : results) {
+        for (size_t slot = 0; slot < stored_slots; ++slot) {
+            put<component_id_t>(contents, result.gizmo->components()[slot].id);
+        }
+        putProbability(contents, result.target_probability);
+    }
+
+    // Concurrent readers see either the old or the new file, and concurrent writers of the same query just race to
+    // store identical results.
+    std::error_code error;
+    std::filesystem::create_directories(directory_, error);
+    return MappedFile::replace(queryPath(key), contents);
+}
+
+uint64_t ResultCache::hashFiles(const std::vector<std::string> &filenames) {
+    uint64_t hash = 14695981039346656037ull;
+    for (const std::string &filename : filenames) {
+        std::ifstream file(filename, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        hash = fnv1a(contents.data(), contents.size(), hash);
+        // Separate the files, so moving bytes from one to the next changes the hash.
+        hash = fnv1a("\0", 1, hash);
+    }
+    return hash;
+}
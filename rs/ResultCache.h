@@ -0,0 +1,70 @@
+#ifndef RSPERKS_RESULTCACHE_H
+#define RSPERKS_RESULTCACHE_H
+
+
+#include "InventionTypes.h"
+#include "Component.h"
+#include "Gizmo.h"
+#include "OptimalGizmoSearch.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// Everything that determines the results of a search, apart from the data files.
+struct ResultCacheQuery {
+    EquipmentType equipment_type;
+    GizmoType gizmo_type;
+    level_t invention_level;
+    GizmoResult target;
+    std::vector<Component> excluded;
+    SearchObjective objective;
+    // Zero for every result.
+    size_t max_results;
+};
+
+struct CachedResult {
+    Gizmo gizmo;
+    probability_t target_probability;
+};
+
+
+/**
+ * Search results kept on disk between runs, so repeating a query does not need the search at all.
+ *
+ * Each query is stored in its own small binary file, named by a hash of the query and of the data files the results
+ * were computed from, so changing the data simply stops old results being found. Files are written to a temporary
+ * name and renamed into place, which replaces them atomically: concurrent readers see either the old or the new
+ * file, never a partial one, and concurrent writers of the same query just race to store identical results.
+ * Anything that fails to load for any reason is treated as a miss.
+ */
+class ResultCache {
+public:
+    // The directory is created when results are first stored. data_hash identifies the data files, see hashFiles.
+    ResultCache(std::string directory, uint64_t data_hash);
+
+    // Loads the cached results for a query, if there are any. Results stored for a larger max_results also answer a
+    // query for fewer.
+    bool load(const ResultCacheQuery &query, std::vector<CachedResult> &results) const;
+
+    // Best effort; returns false if the results could not be written. Results already stored which answer the query
+    // are kept, so storing fewer results never loses a larger set.
+    bool store(const ResultCacheQuery &query, const std::vector<GizmoTargetProbability> &results) const;
+
+    // FNV-1a hash over the contents of the given files.
+    static uint64_t hashFiles(const std::vector<std::string> &filenames);
+
+private:
+    static constexpr uint16_t format_version = 1;
+
+    std::string directory_;
+    uint64_t data_hash_;
+
+    // Canonical bytes identifying the query. Excluded components are sorted and max_results is left out.
+    std::string queryKey(const ResultCacheQuery &query) const;
+
+    std::string queryPath(const std::string &key) const;
+};
+
+
+#endif //RSPERKS_RESULTCACHE_H
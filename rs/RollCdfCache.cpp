@@ -0,0 +1,84 @@
+#include "RollCdfCache.h"
+
+namespace {
+    size_t cdfBytes(const CDF &cdf) {
+        return sizeof(CDF) + cdf.capacity() * sizeof(probability_t);
+    }
+}
+
+RollCdfCache::RollCdfCache(size_t max_bytes) : cdfs_(max_bytes) {
+
+}
+
+bool RollCdfCache::Key::operator==(const Key &other) const {
+    return base == other.base && count == other.count &&
+           std::equal(rolls.begin(), rolls.begin() + count, other.rolls.begin());
+}
+
+std::size_t RollCdfCache::KeyHash::operator()(const Key &key) const {
+    // Only the used bytes of the key.
+    Fnv1aHash hash;
+    for (size_t i = 0; i < sizeof(key.base); ++i) {
+        hash.add(static_cast<uint8_t>(key.base >> (8 * i)));
+    }
+    hash.add(key.count);
+    for (size_t i = 0; i < key.count; ++i) {
+        hash.add(key.rolls[i]);
+    }
+    return hash.value();
+}
+
+std::shared_ptr<const CDF> RollCdfCache::get(int base, std::vector<int> &rolls) {
+    std::sort(rolls.begin(), rolls.end());
+
+    auto compute = [&]() {
+        auto cdf = std::make_shared<CDF>(base, 0);
+        uniformSum(rolls).appendCdf(*cdf);
+        return std::shared_ptr<const CDF>(std::move(cdf));
+    };
+
+    if (rolls.size() > max_rolls) {
+        cdfs_.countMiss();
+        return compute();
+    }
+
+    Key key = {base, static_cast<uint8_t>(rolls.size()), {}};
+    std::copy(rolls.begin(), rolls.end(), key.rolls.begin());
+    std::shared_ptr<const CDF> cdf;
+    auto use = [&cdf](const std::shared_ptr<const CDF> &cached) { cdf = cached; };
+    if (cdfs_.find(key, use)) {
+        return cdf;
+    }
+
+    // Compute without holding the lock. Another thread may get there first, in which case its CDF is used. Callers
+    // holding evicted CDFs keep them alive.
+    std::shared_ptr<const CDF> computed = compute();
+    size_t bytes = cdfBytes(*computed);
+    cdfs_.insert(key, std::move(computed), bytes, use);
+    return cdf;
+}
+
+void RollCdfCache::clear() {
+    cdfs_.clear();
+}
+
+size_t RollCdfCache::hits() const {
+    return cdfs_.hits();
+}
+
+size_t RollCdfCache::misses() const {
+    return cdfs_.misses();
+}
+
+size_t RollCdfCache::entries() const {
+    return cdfs_.entries();
+}
+
+size_t RollCdfCache::bytes() const {
+    return cdfs_.bytes();
+}
+
+RollCdfCache &RollCdfCache::shared() {
+    static RollCdfCache cache;
+    return cache;
+}
@@ -0,0 +1,63 @@
+#ifndef RSPERKS_ROLLCDFCACHE_H
+#define RSPERKS_ROLLCDFCACHE_H
+
+
+#include "InventionTypes.h"
+#include "Probability.h"
+#include "ShardedCache.h"
+#include <array>
+#include <memory>
+#include <vector>
+
+
+/**
+ * Thread-safe memo of perk contribution CDFs, keyed by the base and the multiset of rolls.
+ *
+ * Many gizmos give a perk exactly the same base and rolls, just from different slots. Sums of rolls are computed
+ * exactly (see UniformSumDistribution), so the CDF does not depend on the order of the rolls and sorting them gives
+ * a canonical key. Memory is bounded as described in ShardedCache.
+ *
+ * Only gizmos evaluated on their own, through Gizmo::perkRollCdf, use the cache. The search builds its CDFs in
+ * GizmoPrefixState instead, from roll distributions shared between candidates with a common prefix.
+ */
+class RollCdfCache {
+public:
+    explicit RollCdfCache(size_t max_bytes = 64 * 1024 * 1024);
+
+    // CDF of base plus the sum of the rolls, including the leading zeros below base. Sorts rolls.
+    std::shared_ptr<const CDF> get(int base, std::vector<int> &rolls);
+
+    void clear();
+
+    [[nodiscard]] size_t hits() const;
+
+    [[nodiscard]] size_t misses() const;
+
+    [[nodiscard]] size_t entries() const;
+
+    [[nodiscard]] size_t bytes() const;
+
+    // Cache used by Gizmo::perkRollCdf.
+    static RollCdfCache &shared();
+
+private:
+    // Every roll a perk can get from one gizmo. Perks with more than this are simply not cached.
+    static constexpr size_t max_rolls = 18;
+
+    struct Key {
+        int base;
+        uint8_t count;
+        std::array<uint8_t, max_rolls> rolls;
+
+        bool operator==(const Key &other) const;
+    };
+
+    struct KeyHash {
+        std::size_t operator()(const Key &key) const;
+    };
+
+    ShardedCache<Key, std::shared_ptr<const CDF>, KeyHash> cdfs_;
+};
+
+
+#endif //RSPERKS_ROLLCDFCACHE_H
@@ -0,0 +1,149 @@
+#ifndef RSPERKS_SHARDEDCACHE_H
+#define RSPERKS_SHARDEDCACHE_H
+
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+
+// Incremental FNV-1a, for hashing cache keys a byte at a time.
+class Fnv1aHash {
+public:
+    void add(uint8_t byte) {
+        hash_ ^= byte;
+        hash_ *= 1099511628211ull;
+    }
+
+    [[nodiscard]] std::size_t value() const { return hash_; }
+
+private:
+    std::size_t hash_ = 14695981039346656037ull;
+};
+
+
+/**
+ * Thread-safe map with a bounded memory budget, the storage behind RollCdfCache and DistributionCache.
+ *
+ * The map is split into independently locked shards by key hash, so threads looking up different keys rarely
+ * contend. Each entry is charged the number of bytes its owner says it takes, and once a shard holds more than its
+ * share of the budget, other entries are evicted from it in no particular order until it fits.
+ */
+template<typename Key, typename Value, typename Hash>
+class ShardedCache {
+public:
+    explicit ShardedCache(size_t max_bytes) :
+            max_shard_bytes_(std::max<size_t>(1, max_bytes / shard_count)),
+            hits_(0),
+            misses_(0) {}
+
+    // Calls use with the cached value, under the shard's lock, and counts a hit. Returns false, counting a miss, if
+    // there is none.
+    template<typename F>
+    bool find(const Key &key, F &&use) {
+        Shard &key_shard = shard(key);
+        std::lock_guard<std::mutex> lock(key_shard.mutex);
+        auto found = key_shard.entries.find(key);
+        if (found == key_shard.entries.end()) {
+            misses_++;
+            return false;
+        }
+        hits_++;
+        use(found->second.first);
+        return true;
+    }
+
+    // Adds a value charged with the given number of bytes, unless another thread got there first. Either way, calls use
+    // with the value which is kept, under the shard's lock.
+    template<typename F>
+    void insert(const Key &key, Value value, size_t bytes, F &&use) {
+        Shard &key_shard = shard(key);
+        std::lock_guard<std::mutex> lock(key_shard.mutex);
+        auto inserted = key_shard.entries.emplace(key, std::make_pair(std::move(value), bytes));
+        if (!inserted.second) {
+            use(inserted.first->second.first);
+            return;
+        }
+        key_shard.bytes += bytes;
+
+        // Evict other entries until the shard is back within its budget.
+        auto it = key_shard.entries.begin();
+        while (key_shard.bytes > max_shard_bytes_ && it != key_shard.entries.end()) {
+            if (it == inserted.first) {
+                ++it;
+                continue;
+            }
+            key_shard.bytes -= it->second.second;
+            it = key_shard.entries.erase(it);
+        }
+        use(inserted.first->second.first);
+    }
+
+    void insert(const Key &key, Value value, size_t bytes) {
+        insert(key, std::move(value), bytes, [](const Value &) {});
+    }
+
+    // For lookups which could not use the cache at all.
+    void countMiss() {
+        misses_++;
+    }
+
+    void clear() {
+        for (Shard &key_shard : shards_) {
+            std::lock_guard<std::mutex> lock(key_shard.mutex);
+            key_shard.entries.clear();
+            key_shard.bytes = 0;
+        }
+        hits_ = 0;
+        misses_ = 0;
+    }
+
+    [[nodiscard]] size_t hits() const { return hits_; }
+
+    [[nodiscard]] size_t misses() const { return misses_; }
+
+    [[nodiscard]] size_t entries() const {
+        size_t entries = 0;
+        for (const Shard &key_shard : shards_) {
+            std::lock_guard<std::mutex> lock(key_shard.mutex);
+            entries += key_shard.entries.size();
+        }
+        return entries;
+    }
+
+    [[nodiscard]] size_t bytes() const {
+        size_t bytes = 0;
+        for (const Shard &key_shard : shards_) {
+            std::lock_guard<std::mutex> lock(key_shard.mutex);
+            bytes += key_shard.bytes;
+        }
+        return bytes;
+    }
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    struct Shard {
+        mutable std::mutex mutex;
+        // Each value with the bytes it was charged.
+        std::unordered_map<Key, std::pair<Value, size_t>, Hash> entries;
+        size_t bytes = 0;
+    };
+
+    size_t max_shard_bytes_;
+    std::array<Shard, shard_count> shards_;
+    std::atomic<size_t> hits_;
+    std::atomic<size_t> misses_;
+
+    Shard &shard(const Key &key) {
+        return shards_[Hash{}(key) % shard_count];
+    }
+};
+
+
+#endif //RSPERKS_SHARDEDCACHE_H
@@ -0,0 +1,245 @@
+#include "SimdKernels.h"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RSPERKS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace {
+    // Doubles represent every integer below this exactly, and the AVX2 conversion relies on it.
+    constexpr uint64_t exact_integer_limit = uint64_t(1) << 52;
+
+    void prefixSumScalar(uint64_t *counts, size_t size) {
+        for (size_t i = 1; i < size; ++i) {
+            counts[i] += counts[i - 1];
+        }
+    }
+
+    // Second half of boxSum, from index end - 1 down to window: counts[i] -= counts[i - window].
+    void laggedDifferenceScalar(uint64_t *counts, size_t end, size_t window) {
+        for (size_t i = end; i-- > window;) {
+            counts[i] -= counts[i - window];
+        }
+    }
+
+    void boxSumScalar(uint64_t *counts, size_t input_size, size_t window) {
+        size_t output_size = input_size + window - 1;
+        prefixSumScalar(counts, input_size);
+        std::fill(counts + input_size, counts + output_size, counts[input_size - 1]);
+        laggedDifferenceScalar(counts, output_size, window);
+    }
+
+    void cumulativeProbabilitiesScalar(const uint64_t *counts, size_t size, uint64_t total, probability_t *out) {
+        auto total_probability = static_cast<probability_t>(total);
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < size; ++i) {
+            cumulative += counts[i];
+            out[i] = static_cast<probability_t>(cumulative) / total_probability;
+        }
+    }
+
+    void thresholdDifferencesScalar(const probability_t *cdf, const rank_threshold_t *thresholds, size_t count,
+                                    probability_t *out) {
+        probability_t lower = thresholds[0] > 0 ? cdf[thresholds[0] - 1] : 0.0;
+        for (size_t k = 0; k < count; ++k) {
+            probability_t upper = 1.0;
+            if (k + 1 < count) {
+                upper = thresholds[k + 1] > 0 ? cdf[thresholds[k + 1] - 1] : 0.0;
+            }
+            out[k] = upper - lower;
+            lower = upper;
+        }
+    }
+
+#ifdef RSPERKS_SIMD_X86
+    // Inclusive prefix sum within a vector of four.
+    __attribute__((target("avx2")))
+    inline __m256i scan4(__m256i x) {
+        const __m256i zero = _mm256_setzero_si256();
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x03));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x0F));
+        return x;
+    }
+
+    __attribute__((target("avx2")))
+    void boxSumAvx2(uint64_t *counts, size_t input_size, size_t window) {
+        size_t output_size = input_size + window - 1;
+
+        __m256i carry = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= input_size; i += 4) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts + i));
+            x = _mm256_add_epi64(scan4(x), carry);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(counts + i), x);
+            carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+        for (i = std::max<size_t>(i, 1); i < input_size; ++i) {
+            counts[i] += counts[i - 1];
+        }
+        std::fill(counts + input_size, counts + output_size, counts[input_size - 1]);
+
+        // Working downwards, a block of four only reads entries below it, which are still prefix sums as long as the
+        // window is at least four wide.
+        size_t end = output_size;
+        if (window >= 4) {
+            while (end >= window + 4) {
+                size_t start = end - 4;
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts + start));
+                __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts + start - window));
+                _mm256_storeu_si256(reinterpret_cast<__m256i *>(counts + start), _mm256_sub_epi64(x, y));
+                end = start;
+            }
+        }
+        laggedDifferenceScalar(counts, end, window);
+    }
+
+    __attribute__((target("avx2")))
+    void cumulativeProbabilitiesAvx2(const uint64_t *counts, size_t size, uint64_t total, probability_t *out) {
+        if (total >= exact_integer_limit) {
+            cumulativeProbabilitiesScalar(counts, size, total, out);
+            return;
+        }
+
+        // AVX2 has no unsigned 64-bit conversion, but below 2^52 an integer can be placed straight into the
+        // mantissa of 2^52 and the 2^52 subtracted again.
+        const __m256i magic_bits = _mm256_set1_epi64x(0x4330000000000000);
+        const __m256d magic = _mm256_set1_pd(static_cast<double>(exact_integer_limit));
+        const __m256d total_probability = _mm256_set1_pd(static_cast<probability_t>(total));
+
+        __m256i carry = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+            __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(counts + i));
+            x = _mm256_add_epi64(scan4(x), carry);
+            carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+            __m256d cumulative = _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256(x, magic_bits)), magic);
+            _mm256_storeu_pd(out + i, _mm256_div_pd(cumulative, total_probability));
+        }
+
+        uint64_t cumulative = static_cast<uint64_t>(_mm256_extract_epi64(carry, 0));
+        auto total_scalar = static_cast<probability_t>(total);
+        for (; i < size; ++i) {
+            cumulative += counts[i];
+            out[i] = static_cast<probability_t>(cumulative) / total_scalar;
+        }
+    }
+
+    // Inclusive prefix sum within a vector of eight.
+    __attribute__((target("avx512f")))
+    inline __m512i scan8(__m512i x) {
+        const __m512i zero = _mm512_setzero_si512();
+        x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 7));
+        x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 6));
+        x = _mm512_add_epi64(x, _mm512_alignr_epi64(x, zero, 4));
+        return x;
+    }
+
+    __attribute__((target("avx512f")))
+    void boxSumAvx512(uint64_t *counts, size_t input_size, size_t window) {
+        size_t output_size = input_size + window - 1;
+        const __m512i last_lane = _mm512_set1_epi64(7);
+
+        __m512i carry = _mm512_setzero_si512();
+        size_t i = 0;
+        for (; i + 8 <= input_size; i += 8) {
+            __m512i x = _mm512_add_epi64(scan8(_mm512_loadu_si512(counts + i)), carry);
+            _mm512_storeu_si512(counts + i, x);
+            carry = _mm512_permutexvar_epi64(last_lane, x);
+        }
+        for (i = std::max<size_t>(i, 1); i < input_size; ++i) {
+            counts[i] += counts[i - 1];
+        }
+        std::fill(counts + input_size, counts + output_size, counts[input_size - 1]);
+
+        size_t end = output_size;
+        if (window >= 8) {
+            while (end >= window + 8) {
+                size_t start = end - 8;
+                __m512i x = _mm512_loadu_si512(counts + start);
+                __m512i y = _mm512_loadu_si512(counts + start - window);
+                _mm512_storeu_si512(counts + start, _mm512_sub_epi64(x, y));
+                end = start;
+            }
+        }
+        laggedDifferenceScalar(counts, end, window);
+    }
+
+    __attribute__((target("avx512f,avx512dq")))
+    void cumulativeProbabilitiesAvx512(const uint64_t *counts, size_t size, uint64_t total, probability_t *out) {
+        const __m512i last_lane = _mm512_set1_epi64(7);
+        const __m512d total_probability = _mm512_set1_pd(static_cast<probability_t>(total));
+
+        __m512i carry = _mm512_setzero_si512();
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            __m512i x = _mm512_add_epi64(scan8(_mm512_loadu_si512(counts + i)), carry);
+            carry = _mm512_permutexvar_epi64(last_lane, x);
+            _mm512_storeu_pd(out + i, _mm512_div_pd(_mm512_cvtepu64_pd(x), total_probability));
+        }
+
+        uint64_t cumulative = i > 0 ? static_cast<uint64_t>(_mm_cvtsi128_si64(_mm512_castsi512_si128(carry))) : 0;
+        auto total_scalar = static_cast<probability_t>(total);
+        for (; i < size; ++i) {
+            cumulative += counts[i];
+            out[i] = static_cast<probability_t>(cumulative) / total_scalar;
+        }
+    }
+#endif
+
+    struct Kernels {
+        const char *instruction_set;
+        void (*box_sum)(uint64_t *, size_t, size_t);
+        void (*cumulative_probabilities)(const uint64_t *, size_t, uint64_t, probability_t *);
+    };
+
+    Kernels selectKernels() {
+        Kernels scalar = {"scalar", boxSumScalar, cumulativeProbabilitiesScalar};
+
+#ifdef RSPERKS_SIMD_X86
+        const char *forced = std::getenv("RSPERKS_SIMD");
+        std::string limit = forced ? forced : "";
+
+        __builtin_cpu_init();
+        if (limit != "scalar" && limit != "avx2" &&
+            __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) {
+            return {"avx512", boxSumAvx512, cumulativeProbabilitiesAvx512};
+        }
+        if (limit != "scalar" && __builtin_cpu_supports("avx2")) {
+            return {"avx2", boxSumAvx2, cumulativeProbabilitiesAvx2};
+        }
+#endif
+
+        return scalar;
+    }
+
+    const Kernels &kernels() {
+        static const Kernels selected = selectKernels();
+        return selected;
+    }
+}
+
+void rs::simd::boxSum(uint64_t *counts, size_t input_size, size_t window) {
+    kernels().box_sum(counts, input_size, window);
+}
+
+void rs::simd::cumulativeProbabilities(const uint64_t *counts, size_t size, uint64_t total, probability_t *out) {
+    kernels().cumulative_probabilities(counts, size, total, out);
+}
+
+void rs::simd::thresholdDifferences(const probability_t *cdf, const rank_threshold_t *thresholds, size_t count,
+                                    probability_t *out) {
+    // Gathering the handful of thresholds a perk has into vectors costs more than it saves, so this always runs the
+    // scalar version.
+    if (count == 0) {
+        return;
+    }
+    thresholdDifferencesScalar(cdf, thresholds, count, out);
+}
+
+const char *rs::simd::instructionSet() {
+    return kernels().instruction_set;
+}
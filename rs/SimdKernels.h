@@ -0,0 +1,40 @@
+#ifndef RSPERKS_SIMDKERNELS_H
+#define RSPERKS_SIMDKERNELS_H
+
+
+#include "InventionTypes.h"
+#include <cstddef>
+#include <cstdint>
+
+
+/**
+ * Vectorised kernels for the per-candidate probability calculations.
+ *
+ * The distribution kernels have AVX-512 and AVX2 versions alongside a scalar fallback, and the best one the CPU
+ * supports is picked at runtime. The RSPERKS_SIMD environment variable ("scalar", "avx2" or "avx512") can force a
+ * lower level, e.g. to compare them. The kernels only use exact integer arithmetic and the same floating point
+ * operations in the same order as the scalar versions, so every version gives bit-for-bit identical results.
+ */
+namespace rs::simd {
+    // Sliding window sum, in place. The first input_size entries of counts are replaced by the sums of every window
+    // entries wide window over them (treating anything outside as zero), so counts must have room for
+    // input_size + window - 1 entries.
+    void boxSum(uint64_t *counts, size_t input_size, size_t window);
+
+    // out[i] = (counts[0] + ... + counts[i]) / total.
+    void cumulativeProbabilities(const uint64_t *counts, size_t size, uint64_t total, probability_t *out);
+
+    // Probability of landing in each band between consecutive thresholds: out[k] is upper - lower, with lower being
+    // cdf[thresholds[k] - 1] (zero for a threshold of zero) and upper being the next band's lower, or 1.0 for the last.
+    // Every threshold must be a valid index into cdf. At most max_thresholds thresholds.
+    constexpr size_t max_thresholds = 8;
+
+    void thresholdDifferences(const probability_t *cdf, const rank_threshold_t *thresholds, size_t count,
+                              probability_t *out);
+
+    // Instruction set the kernels are running with.
+    const char *instructionSet();
+}
+
+
+#endif //RSPERKS_SIMDKERNELS_H